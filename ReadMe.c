@@ -64,6 +64,16 @@ struct option long_options[] = {
 	{"report-wiggles", 0, 0, REPORT_WIGGLES},
 	{"non-space",	0, 0, NON_SPACE},
 	{"shortest",	0, 0, SHORTEST},
+	{"patience",	0, 0, PATIENCE},
+	{"check",	0, 0, CHECK},
+	{"window",	1, 0, MERGE_WINDOW},
+	{"sync",	1, 0, SYNC},
+	{"journal",	1, 0, JOURNAL},
+	{"max-memory",	1, 0, MAX_MEMORY},
+	{"compile",	1, 0, COMPILE},
+	{"revision",	1, 0, REVISION},
+	{"watch",	0, 0, WATCH},
+	{"search",	1, 0, SEARCH},
 	{0, 0, 0, 0}
 };
 
@@ -88,6 +98,7 @@ char Help[] =  "\n"
 "   --words     -w    : word-wise diff and merge.\n"
 "   --lines     -l    : line-wise diff and merge.\n"
 "   --non-space       : words are separated by spaces.\n"
+"   --patience        : align unique words or lines first.\n"
 "\n"
 "   --patch     -p    : treat last file as a patch file.\n"
 "   -1  -2  -3        : select which component of patch or merge to use.\n"
@@ -102,6 +113,15 @@ char Help[] =  "\n"
 "\n"
 "   --replace   -r    : replace first file with result of merger.\n"
 "   --no-backup       : Never save original file (as name.porig).\n"
+"   --sync=how        : flush replaced files: none, file or batch.\n"
+"   --journal=file    : record progress of -p so it can be resumed.\n"
+"   --check           : only count conflicts, don't produce a merge.\n"
+"   --window=lines    : merge a huge file a window at a time.\n"
+"   --max-memory=size : merge more coarsely rather than use more memory.\n"
+"   --compile=bundle  : prepare a patch (-p) to be applied many times.\n"
+"   --revision=rev    : with -p, patch files as they are in git revision rev.\n"
+"   --watch           : merge again each time one of the files changes.\n"
+"   --search=dir      : look under dir for hunks that have moved.\n"
 "\n"
 "   --strip=    -p    : number of path components to strip from file names.\n"
 "\n"
@@ -164,6 +184,48 @@ char HelpMerge[] = "\n"
 "If --merge is given three files, they are each treated as whole files\n"
 "and differences between the second and third are merged into the first.\n"
 "This usage is much like 'merge'.\n"
+"\n"
+"With --check no merge is output.  Conflicts are counted and reported\n"
+"and the exit status is set as usual.  With --check and --quiet wiggle\n"
+"stops at the first conflict found.  --check can be used with -p in\n"
+"place of --replace.\n"
+"\n"
+"With --window=N and a file and a patch, the file is read a piece at a\n"
+"time and each hunk is only looked for within N lines of where the patch\n"
+"says it belongs.  This bounds the memory needed for very large files.\n"
+"\n"
+"With --replace, --sync=file flushes each new file to storage before it\n"
+"replaces the original, and --sync=batch flushes every filesystem written\n"
+"to once, just before wiggle exits.  The default, --sync=none, leaves this\n"
+"to the kernel.\n"
+"\n"
+"With --max-memory=size (e.g. 500M), a merge estimated to need more\n"
+"memory is done by whole words, then by lines, and finally (for a file\n"
+"and a patch) a window at a time, and the fallback used is reported.\n"
+"\n"
+"With -p and --replace, --journal=file records each file as it is\n"
+"replaced.  If wiggle is interrupted, running it again with the same\n"
+"journal skips the files that were already done.\n"
+"\n"
+"With -p, --compile=bundle doesn't merge anything but saves the patch,\n"
+"already split into words and diffed, in 'bundle'.  The bundle can\n"
+"then be given to -p in place of the patch, which saves repeating that\n"
+"work each time it is applied.\n"
+"\n"
+"With -p, --revision=rev reads the files to patch from the git\n"
+"repository in the current directory as they are in 'rev', without\n"
+"checking it out.  Use it with --check, or with --output=dir to write\n"
+"each merged file under 'dir'.\n"
+"\n"
+"With --watch, wiggle doesn't exit after merging but waits for one of\n"
+"the files to be saved and merges again, reusing what it can of the\n"
+"previous merge.  Use it with --check, to see the conflict count each\n"
+"time, or with --output to have the result rewritten.\n"
+"\n"
+"With a patch, --search=dir looks for any hunk that can't be found in\n"
+"the file it names in the other files under 'dir', and reports where\n"
+"it has moved to.  An index of 'dir' is kept in dir/.wiggle-index so\n"
+"that only files that have changed are read again next time.\n"
 "\n";
 
 char HelpBrowse[] = "\n"
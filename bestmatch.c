@@ -169,6 +169,32 @@ static inline int min(int a, int b)
 	return a < b ? a : b;
 }
 
+/* Cells examined by find_best() in this wiggle_pdiff(), for tracing */
+static long trace_cells;
+
+/* Also for tracing, each position which find_best() took as the best
+ * for a hunk until it found a better one.
+ */
+static struct candidate {
+	int hunk;
+	struct best b;
+} *candidates;
+static int ncandidates, acandidates;
+
+static void note_candidate(int hunk, struct best *b)
+{
+	if (ncandidates >= acandidates) {
+		acandidates = acandidates ? acandidates * 2 : 16;
+		candidates = realloc(candidates,
+				     sizeof(*candidates) * acandidates);
+		if (!candidates)
+			wiggle_die("memory allocation");
+	}
+	candidates[ncandidates].hunk = hunk;
+	candidates[ncandidates].b = *b;
+	ncandidates++;
+}
+
 static void find_best(struct file *a, struct file *b,
 		      int alo, int ahi,
 		      int blo, int bhi, struct best *best)
@@ -187,6 +213,12 @@ static void find_best(struct file *a, struct file *b,
 	while (f < ahi+bhi) {
 		int x, y;
 
+		/* If asked to hurry, settle for the best found so far.
+		 * place_as_stated() deals with any hunk not yet found.
+		 */
+		if (wiggle_poll((khi - klo) / 2 + 1))
+			break;
+		trace_cells += (khi - klo) / 2 + 1;
 		f++;
 		for (k = klo+1; k <= khi-1 ; k += 2) {
 			struct v vnew, vnew2;
@@ -202,6 +234,12 @@ static void find_best(struct file *a, struct file *b,
 					abort();
 				if (v[k].val > best[v[k].c].val) {
 					int chunk = v[k].c;
+					if (wiggle_trace_file &&
+					    best[chunk].val > 0 &&
+					    (best[chunk].xlo != v[k].x ||
+					     best[chunk].ylo != v[k].y))
+						note_candidate(chunk,
+							       &best[chunk]);
 					best[chunk].xlo = v[k].x;
 					best[chunk].ylo = v[k].y;
 					best[chunk].xhi = x;
@@ -393,15 +431,43 @@ static void find_best_inorder(struct file *a, struct file *b,
 	int i;
 	int bad = 0;
 	int bestval, bestpos = 0;
+	long cells = trace_cells, start = 0;
 
 	for (i = bestlo; i < besthi; i++)
 		best[i].val = 0;
+	if (wiggle_trace_file)
+		start = wiggle_trace_usec();
+	ncandidates = 0;
 	find_best(a, b, alo, ahi, blo, bhi, best);
 	for (i = bestlo + 1; i < besthi; i++)
 		if (best[i-1].val > 0 &&
 		    best[i].val > 0 &&
 		    best[i-1].xhi >= best[i].xlo)
 			bad = 1;
+	if (wiggle_trace_file) {
+		/* Positions are in the reduced files */
+		wiggle_trace_event("find_best");
+		fprintf(wiggle_trace_file,
+			",\"a\":[%d,%d],\"b\":[%d,%d],"
+			"\"cells\":%ld,\"usec\":%ld,\"inorder\":%s,\"best\":[",
+			alo, ahi, blo, bhi, trace_cells - cells,
+			wiggle_trace_usec() - start, bad ? "false" : "true");
+		for (i = bestlo; i < besthi; i++)
+			fprintf(wiggle_trace_file,
+				"%s{\"hunk\":%d,\"val\":%d,\"a\":[%d,%d],\"b\":[%d,%d]}",
+				i > bestlo ? "," : "", i, best[i].val,
+				best[i].xlo, best[i].xhi,
+				best[i].ylo, best[i].yhi);
+		fprintf(wiggle_trace_file, "],\"candidates\":[");
+		for (i = 0; i < ncandidates; i++)
+			fprintf(wiggle_trace_file,
+				"%s{\"hunk\":%d,\"val\":%d,\"a\":[%d,%d],\"b\":[%d,%d]}",
+				i ? "," : "", candidates[i].hunk,
+				candidates[i].b.val,
+				candidates[i].b.xlo, candidates[i].b.xhi,
+				candidates[i].b.ylo, candidates[i].b.yhi);
+		fprintf(wiggle_trace_file, "]}\n");
+	}
 
 	if (!bad)
 		return;
@@ -433,6 +499,94 @@ static void find_best_inorder(struct file *a, struct file *b,
 	}
 }
 
+/* wiggle_diff_partial(), noting the size of the region for the trace */
+static struct csl *partial(struct file a, struct file b,
+			   int alo, int ahi, int blo, int bhi,
+			   int sizes[3][2], int *n)
+{
+	sizes[*n][0] = ahi - alo;
+	sizes[*n][1] = bhi - blo;
+	*n += 1;
+	return wiggle_diff_partial(a, b, alo, ahi, blo, bhi);
+}
+
+/* A hurried find_best() may stop before some hunks have been found
+ * at all.  Rather than lose them, put each where its chunk marker says
+ * the patch expected it, kept between the hunks either side.  As the
+ * file has often moved on since the patch was made, the range given to
+ * wiggle_diff_partial() has as many lines again before and after.  The
+ * value of 1 just marks the hunk as placed.
+ */
+static void place_as_stated(struct file a, struct file b,
+			    struct best *best, int chunks)
+{
+	int i, j, y = 0, xmin = 0;
+
+	for (i = 1; i <= chunks; i++) {
+		int chunk, line = 0, cnt, lines = 0;
+		int xlo, xhi, xmax, yhi;
+
+		while (y < b.elcnt && !(b.list[y].start[0] == 0 &&
+					atoi(b.list[y].start + 1) == i))
+			y++;
+		if (y >= b.elcnt)
+			break;
+		if (best[i].val > 0) {
+			xmin = best[i].xhi;
+			continue;
+		}
+		sscanf(b.list[y].start + 1, "%d %d %d", &chunk, &line, &cnt);
+		for (yhi = y + 1; yhi < b.elcnt && b.list[yhi].start[0]; yhi++)
+			lines += !!ends_line(b.list[yhi]);
+		xmax = a.elcnt;
+		for (j = i + 1; j <= chunks; j++)
+			if (best[j].val > 0) {
+				xmax = best[j].xlo;
+				break;
+			}
+		/* Find the start of 'line', less the slack */
+		line -= lines;
+		for (xlo = 0; xlo < a.elcnt && line > 1; xlo++)
+			line -= !!ends_line(a.list[xlo]);
+		if (xlo < xmin)
+			xlo = xmin;
+		if (xlo > xmax)
+			xlo = xmax;
+		lines *= 3;
+		for (xhi = xlo; lines && xhi < xmax; xhi++)
+			lines -= !!ends_line(a.list[xhi]);
+		best[i].xlo = xlo;
+		best[i].xhi = xhi;
+		best[i].ylo = y + 1;
+		best[i].yhi = yhi;
+		best[i].val = 1;
+		xmin = xhi;
+	}
+}
+
+static void trace_hunk(int hunk, struct best *bst, int sizes[3][2], int n,
+		       long start)
+{
+	int j;
+
+	if (bst->val <= 0) {
+		wiggle_trace_event("hunk");
+		fprintf(wiggle_trace_file, ",\"hunk\":%d,\"lost\":true}\n",
+			hunk);
+		return;
+	}
+	wiggle_trace_event("hunk");
+	fprintf(wiggle_trace_file,
+		",\"hunk\":%d,\"val\":%d,"
+		"\"a\":[%d,%d],\"b\":[%d,%d],\"partial\":[",
+		hunk, bst->val, bst->xlo, bst->xhi, bst->ylo, bst->yhi);
+	for (j = 0; j < n; j++)
+		fprintf(wiggle_trace_file, "%s[%d,%d]", j ? "," : "",
+			sizes[j][0], sizes[j][1]);
+	fprintf(wiggle_trace_file, "],\"usec\":%ld}\n",
+		wiggle_trace_usec() - start);
+}
+
 struct csl *wiggle_pdiff(struct file a, struct file b, int chunks)
 {
 	struct csl *csl1, *csl2;
@@ -440,7 +594,12 @@ struct csl *wiggle_pdiff(struct file a, struct file b, int chunks)
 	int i;
 	struct file asmall, bsmall;
 	int xmin;
+	long start = 0, hstart = 0, search = 0;
+	int sizes[3][2], n;
 
+	if (wiggle_trace_file)
+		start = wiggle_trace_usec();
+	trace_cells = 0;
 	asmall = reduce(a);
 	bsmall = reduce(b);
 
@@ -450,6 +609,18 @@ struct csl *wiggle_pdiff(struct file a, struct file b, int chunks)
 			  0, asmall.elcnt, 0, bsmall.elcnt,
 			  best, 1, chunks+1);
 	remap(best, chunks+1, asmall, bsmall, a, b);
+	if (wiggle_hurry == WIGGLE_HURRY)
+		place_as_stated(a, b, best, chunks);
+	if (wiggle_trace_file) {
+		search = wiggle_trace_usec() - start;
+		wiggle_trace_event("pdiff");
+		fprintf(wiggle_trace_file,
+			",\"a\":%d,\"b\":%d,"
+			"\"reduced\":[%d,%d],\"hunks\":%d,\"cells\":%ld,"
+			"\"usec\":%ld}\n",
+			a.elcnt, b.elcnt, asmall.elcnt, bsmall.elcnt,
+			chunks, trace_cells, search);
+	}
 	if (asmall.list != a.list)
 		free(asmall.list);
 	if (bsmall.list != b.list)
@@ -457,7 +628,10 @@ struct csl *wiggle_pdiff(struct file a, struct file b, int chunks)
 
 	csl1 = NULL;
 	xmin = 0;
-	for (i = 1; i <= chunks; i++)
+	for (i = 1; i <= chunks; i++) {
+		n = 0;
+		if (wiggle_trace_file)
+			hstart = wiggle_trace_usec();
 		if (best[i].val > 0) {
 			/* If we there are any newlines in the hunk before
 			 * ylo, then extend xlo back that many newlines if
@@ -478,18 +652,18 @@ struct csl *wiggle_pdiff(struct file a, struct file b, int chunks)
 				}
 				while (xlo > xmin && !ends_line(a.list[xlo-1]))
 					xlo--;
-				csl2 = wiggle_diff_partial(a, b,
-							   xlo, best[i].xlo,
-							   ylo, best[i].ylo);
+				csl2 = partial(a, b,
+					       xlo, best[i].xlo,
+					       ylo, best[i].ylo, sizes, &n);
 				csl1 = wiggle_csl_join(csl1, csl2);
 			}
 
 			/* Now wiggle_diff_partial the good bit of the hunk with the
 			 * good match
 			 */
-			csl2 = wiggle_diff_partial(a, b,
-						   best[i].xlo, best[i].xhi,
-						   best[i].ylo, best[i].yhi);
+			csl2 = partial(a, b,
+				       best[i].xlo, best[i].xhi,
+				       best[i].ylo, best[i].yhi, sizes, &n);
 			csl1 = wiggle_csl_join(csl1, csl2);
 
 			/* Now if there are newlines at the end of the
@@ -512,15 +686,24 @@ struct csl *wiggle_pdiff(struct file a, struct file b, int chunks)
 					lines -= !!ends_line(a.list[xhi]);
 					xhi++;
 				}
-				csl2 = wiggle_diff_partial(a, b,
-							   best[i].xhi, xhi,
-							   best[i].yhi, yhi);
+				csl2 = partial(a, b,
+					       best[i].xhi, xhi,
+					       best[i].yhi, yhi, sizes, &n);
 				csl1 = wiggle_csl_join(csl1, csl2);
 				xmin = xhi;
 			}
 		} else {
 			/* FIXME we just lost a hunk!! */;
 		}
+		if (wiggle_trace_file)
+			trace_hunk(i, &best[i], sizes, n, hstart);
+	}
+	if (wiggle_trace_file) {
+		wiggle_trace_event("pdiff_done");
+		fprintf(wiggle_trace_file,
+			",\"search_usec\":%ld,\"usec\":%ld}\n",
+			search, wiggle_trace_usec() - start);
+	}
 	if (csl1) {
 		for (csl2 = csl1; csl2->len; csl2++)
 			;
@@ -535,3 +718,46 @@ struct csl *wiggle_pdiff(struct file a, struct file b, int chunks)
 	free(best);
 	return csl1;
 }
+
+/* Find where the hunk at b.list[blo..bhi), which starts with its chunk
+ * marker, best matches anywhere in 'a', as wiggle_pdiff() would if the
+ * patch had named 'a'.  This is for looking for a hunk in files other
+ * than the one the patch names, see relocate.c.
+ * Returns the value of the match, or 0 if there is none, with the
+ * words it covers in 'a' in *xlop and *xhip.  *sizep is set to the
+ * number of interesting words in the hunk, against which the value
+ * can be judged.
+ */
+int wiggle_find_hunk(struct file a, struct file b, int blo, int bhi,
+		     int *xlop, int *xhip, int *sizep)
+{
+	struct file asmall, bsmall, bsub;
+	struct best *best;
+	int chunk = b.list[blo].hash;
+	int i, val;
+
+	bsub.list = b.list + blo;
+	bsub.elcnt = bhi - blo;
+	bsmall = reduce(bsub);
+	*sizep = bsmall.elcnt - 1;
+	if (a.elcnt == 0 || bsmall.elcnt <= 1) {
+		if (bsmall.list != bsub.list)
+			free(bsmall.list);
+		return 0;
+	}
+	asmall = reduce(a);
+	best = wiggle_xmalloc(sizeof(struct best)*(chunk+1));
+	for (i = 0; i <= chunk; i++)
+		best[i].val = 0;
+	find_best(&asmall, &bsmall, 0, asmall.elcnt, 0, bsmall.elcnt, best);
+	remap(best, chunk+1, asmall, bsmall, a, bsub);
+	val = best[chunk].val;
+	*xlop = best[chunk].xlo;
+	*xhip = best[chunk].xhi;
+	if (asmall.list != a.list)
+		free(asmall.list);
+	if (bsmall.list != bsub.list)
+		free(bsmall.list);
+	free(best);
+	return val;
+}
@@ -0,0 +1,385 @@
+/*
+ * wiggle - apply rejected patches
+ *
+ * Copyright (C) 2003 Neil Brown <neilb@cse.unsw.edu.au>
+ * Copyright (C) 2010-2013 Neil Brown <neilb@suse.de>
+ * Copyright (C) 2014-2020 Neil Brown <neil@brown.name>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.
+ *
+ *    Author: Neil Brown
+ *    Email: <neil@brown.name>
+ */
+
+/*
+ * Compiled patches, or "bundles".
+ *
+ * Before a multi-file patch can be merged with anything, each file's
+ * section must be found and split into before and after text, those
+ * split into words, and the words diffed.  None of that depends on
+ * the files being patched, so when the same patch is applied often
+ * it can be done once with --compile and the result kept in a bundle,
+ * which -p accepts in place of the patch.
+ *
+ * A bundle is mapped, not read.  Everything in it is found by offset
+ * from the start: a header, the text and words of each file in turn,
+ * then an index with one entry per file.  Words are stored as
+ * struct elmnt with the offset of the text in 'start', and only
+ * changed to pointers when a merge can use them, which is when it
+ * splits and diffs the same way as the bundle was compiled.
+ * Otherwise only the text is used.
+ *
+ * The layout is that of the build of wiggle that wrote it, so the
+ * header records what it depends on, including the versions of
+ * wiggle_hash() and of the word splitting, and a bundle from a
+ * different build is refused.
+ */
+
+#include	"wiggle.h"
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<stdlib.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+
+#define BUNDLE_MAGIC "\0wiggle\n"
+#define BUNDLE_VERSION 2
+#define BUNDLE_ORDER 0x01020304
+
+struct bundle_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;		/* BUNDLE_ORDER, to check byte order */
+	uint32_t elmnt_size, csl_size, ptr_size;
+	uint32_t hash_version, split_version;
+	int32_t type, flags;	/* how the words were split and diffed */
+	uint32_t files;
+	uint64_t index;		/* offset of files * struct bundle_entry */
+	uint64_t size;
+};
+
+struct bundle_entry {
+	uint64_t name;
+	uint32_t start, end;	/* range of the section in the patch */
+	int32_t chunks;
+	int32_t len[2], elcnt[2], csl_cnt;
+	uint64_t text[2], list[2], csl;
+};
+
+struct bundle {
+	char *base;
+	struct bundle_header *hd;
+	struct bundle_entry *ent;
+	char *relocated;	/* entries with pointers in their words */
+};
+
+/* Write 'len' bytes and pad to a multiple of 8, returning the offset
+ * they were written at.
+ */
+static uint64_t put(FILE *f, void *data, long len)
+{
+	static char zero[8];
+	uint64_t off = ftell(f);
+
+	fwrite(data, 1, len, f);
+	if (len % 8)
+		fwrite(zero, 1, 8 - len % 8, f);
+	return off;
+}
+
+static uint64_t put_text(FILE *f, struct stream s)
+{
+	uint64_t off = put(f, s.body, s.len);
+
+	/* split_stream() may look one byte past the end */
+	if (s.len % 8 == 0)
+		fwrite("\0\0\0\0\0\0\0\0", 1, 8, f);
+	return off;
+}
+
+static uint64_t put_words(FILE *f, struct file fl, char *body, uint64_t text)
+{
+	int i;
+
+	for (i = 0; i < fl.elcnt; i++)
+		fl.list[i].start = (char *)(uintptr_t)
+			(text + (fl.list[i].start - body));
+	return put(f, fl.list, fl.elcnt * sizeof(struct elmnt));
+}
+
+/* Compile the multi-file patch 'patchname' into 'name', splitting
+ * words according to 'type' and diffing them with 'flags'.
+ * Returns 0 on success or 2 after reporting an error.
+ */
+int wiggle_compile(char *patchname, char *name, int type, int flags)
+{
+	struct bundle_header hd = {};
+	struct bundle_entry *ent;
+	struct plist *pl;
+	FILE *f, *out;
+	int num, i, j;
+
+	f = wiggle_fopen(patchname);
+	if (!f) {
+		fprintf(stderr, "%s: cannot open %s\n", wiggle_Cmd, patchname);
+		return 2;
+	}
+	pl = wiggle_parse_patch(f, NULL, &num);
+	out = fopen(name, "w");
+	if (!out) {
+		fprintf(stderr, "%s: cannot create %s - %s\n",
+			wiggle_Cmd, name, strerror(errno));
+		fclose(f);
+		return 2;
+	}
+	ent = wiggle_xmalloc(num * sizeof(*ent) + 1);
+	put(out, &hd, sizeof(hd));
+	for (i = 0; i < num; i++) {
+		struct stream sp, s[2];
+		struct file fl[2];
+		struct csl *csl;
+
+		sp = wiggle_load_segment(f, pl[i].start, pl[i].end);
+		memset(&ent[i], 0, sizeof(ent[i]));
+		ent[i].name = put(out, pl[i].file, strlen(pl[i].file) + 1);
+		ent[i].start = pl[i].start;
+		ent[i].end = pl[i].end;
+		ent[i].chunks = wiggle_split_patch(sp, &s[0], &s[1]);
+		free(sp.body);
+		if (!s[0].body || !s[1].body) {
+			fprintf(stderr, "%s: %s: patch for %s looks bad\n",
+				wiggle_Cmd, patchname, pl[i].file);
+			free(s[0].body);
+			free(s[1].body);
+			goto fail;
+		}
+		for (j = 0; j < 2; j++)
+			fl[j] = wiggle_split_stream(s[j], type);
+		csl = wiggle_diff_patch(fl[0], fl[1], flags);
+		for (j = 0; j < 2; j++) {
+			ent[i].len[j] = s[j].len;
+			ent[i].elcnt[j] = fl[j].elcnt;
+			ent[i].text[j] = put_text(out, s[j]);
+			ent[i].list[j] = put_words(out, fl[j], s[j].body,
+						   ent[i].text[j]);
+			free(fl[j].list);
+			free(s[j].body);
+		}
+		for (j = 0; csl[j].len; j++)
+			;
+		ent[i].csl_cnt = j + 1;
+		ent[i].csl = put(out, csl, ent[i].csl_cnt * sizeof(*csl));
+		free(csl);
+	}
+	fclose(f);
+	wiggle_plist_free(pl, num);
+
+	memcpy(hd.magic, BUNDLE_MAGIC, sizeof(hd.magic));
+	hd.version = BUNDLE_VERSION;
+	hd.order = BUNDLE_ORDER;
+	hd.elmnt_size = sizeof(struct elmnt);
+	hd.csl_size = sizeof(struct csl);
+	hd.ptr_size = sizeof(char *);
+	hd.hash_version = WIGGLE_HASH_VERSION;
+	hd.split_version = WIGGLE_SPLIT_VERSION;
+	hd.type = type;
+	hd.flags = flags;
+	hd.files = num;
+	hd.index = put(out, ent, num * sizeof(*ent));
+	hd.size = ftell(out);
+	free(ent);
+	rewind(out);
+	fwrite(&hd, 1, sizeof(hd), out);
+	if (fclose(out) != 0) {
+		fprintf(stderr, "%s: cannot write %s - %s\n",
+			wiggle_Cmd, name, strerror(errno));
+		unlink(name);
+		return 2;
+	}
+	return 0;
+
+fail:
+	fclose(f);
+	fclose(out);
+	unlink(name);
+	wiggle_plist_free(pl, num);
+	free(ent);
+	return 2;
+}
+
+static int entry_valid(struct bundle_entry *e, uint64_t size)
+{
+	int j;
+
+	if (e->name >= size || e->csl_cnt < 1 ||
+	    e->csl + (uint64_t)e->csl_cnt * sizeof(struct csl) > size)
+		return 0;
+	for (j = 0; j < 2; j++)
+		if (e->len[j] < 0 || e->elcnt[j] < 0 ||
+		    e->text[j] + e->len[j] >= size ||
+		    e->list[j] + (uint64_t)e->elcnt[j] * sizeof(struct elmnt)
+		    > size)
+			return 0;
+	return 1;
+}
+
+/* Map the bundle 'name'.  If it isn't a bundle (or can't be opened),
+ * NULL is returned with errno set to zero.  If it is one but cannot be used, a message is
+ * printed and NULL returned with errno set.
+ */
+struct bundle *wiggle_bundle_open(char *name)
+{
+	struct bundle_header hd;
+	struct bundle *b;
+	struct stat stb;
+	char *base;
+	unsigned int i;
+	int fd;
+
+	errno = 0;
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		/* Leave it to be reported as a patch */
+		errno = 0;
+		return NULL;
+	}
+	if (read(fd, &hd, sizeof(hd)) != sizeof(hd) ||
+	    memcmp(hd.magic, BUNDLE_MAGIC, sizeof(hd.magic)) != 0) {
+		close(fd);
+		errno = 0;
+		return NULL;
+	}
+	if (hd.version != BUNDLE_VERSION || hd.order != BUNDLE_ORDER ||
+	    hd.elmnt_size != sizeof(struct elmnt) ||
+	    hd.csl_size != sizeof(struct csl) ||
+	    hd.ptr_size != sizeof(char *) ||
+	    hd.hash_version != WIGGLE_HASH_VERSION ||
+	    hd.split_version != WIGGLE_SPLIT_VERSION) {
+		fprintf(stderr, "%s: %s was compiled by a different build of wiggle\n",
+			wiggle_Cmd, name);
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	if (fstat(fd, &stb) != 0 || (uint64_t)stb.st_size != hd.size ||
+	    hd.index + (uint64_t)hd.files * sizeof(struct bundle_entry)
+	    > hd.size)
+		goto bad;
+	/* Private and writable, so words can be given pointers in place */
+	base = mmap(NULL, hd.size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: cannot map %s - %s\n",
+			wiggle_Cmd, name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	b = wiggle_xmalloc(sizeof(*b));
+	b->base = base;
+	b->hd = (struct bundle_header *)base;
+	b->ent = (struct bundle_entry *)(base + hd.index);
+	for (i = 0; i < hd.files; i++)
+		if (!entry_valid(&b->ent[i], hd.size)) {
+			munmap(base, hd.size);
+			free(b);
+			fd = -1;
+			goto bad;
+		}
+	b->relocated = calloc(hd.files + 1, 1);
+	if (!b->relocated)
+		wiggle_die("memory allocation");
+	return b;
+
+bad:
+	fprintf(stderr, "%s: %s: bundle is corrupt\n", wiggle_Cmd, name);
+	if (fd >= 0)
+		close(fd);
+	errno = EINVAL;
+	return NULL;
+}
+
+/* The files patched by the bundle, as wiggle_parse_patch() lists them */
+struct plist *wiggle_bundle_plist(struct bundle *b, int *np)
+{
+	struct plist *pl;
+	unsigned int i;
+
+	pl = wiggle_xmalloc(b->hd->files * sizeof(*pl) + 1);
+	memset(pl, 0, b->hd->files * sizeof(*pl));
+	for (i = 0; i < b->hd->files; i++) {
+		pl[i].file = strdup(b->base + b->ent[i].name);
+		pl[i].start = b->ent[i].start;
+		pl[i].end = b->ent[i].end;
+		pl[i].chunks = b->ent[i].chunks;
+		pl[i].parent = pl[i].next = pl[i].prev = pl[i].last = -1;
+	}
+	*np = b->hd->files;
+	return pl;
+}
+
+/* The before and after text of file 'i', and the number of chunks */
+int wiggle_bundle_patch(struct bundle *b, int i,
+			struct stream *before, struct stream *after)
+{
+	struct bundle_entry *e = &b->ent[i];
+
+	before->body = b->base + e->text[0];
+	before->len = e->len[0];
+	after->body = b->base + e->text[1];
+	after->len = e->len[1];
+	return e->chunks;
+}
+
+/* If file 'i' was split by 'type' and diffed with 'flags', give the
+ * words and the diff of the before and after text, and return 1.
+ * Otherwise they must be computed, and 0 is returned.
+ */
+int wiggle_bundle_words(struct bundle *b, int i, int type, int flags,
+			struct file *before, struct file *after,
+			struct csl **csl)
+{
+	struct bundle_entry *e = &b->ent[i];
+	struct file fl[2];
+	int j, k;
+
+	if (type != b->hd->type || flags != b->hd->flags)
+		return 0;
+	for (j = 0; j < 2; j++) {
+		fl[j].list = (struct elmnt *)(b->base + e->list[j]);
+		fl[j].elcnt = e->elcnt[j];
+	}
+	if (!b->relocated[i]) {
+		for (j = 0; j < 2; j++)
+			for (k = 0; k < fl[j].elcnt; k++) {
+				uintptr_t off = (uintptr_t)fl[j].list[k].start;
+
+				if (off < e->text[j] || fl[j].list[k].len < 0 ||
+				    off + fl[j].list[k].len >
+				    e->text[j] + e->len[j])
+					/* corrupt, so split the text again */
+					return 0;
+			}
+		for (j = 0; j < 2; j++)
+			for (k = 0; k < fl[j].elcnt; k++)
+				fl[j].list[k].start = b->base +
+					(uintptr_t)fl[j].list[k].start;
+		b->relocated[i] = 1;
+	}
+	*before = fl[0];
+	*after = fl[1];
+	*csl = (struct csl *)(b->base + e->csl);
+	return 1;
+}
@@ -0,0 +1,366 @@
+/*
+ * wiggle - apply rejected patches
+ *
+ * Copyright (C) 2003 Neil Brown <neilb@cse.unsw.edu.au>
+ * Copyright (C) 2010-2013 Neil Brown <neilb@suse.de>
+ * Copyright (C) 2014-2020 Neil Brown <neil@brown.name>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.
+ *
+ *    Author: Neil Brown
+ *    Email: <neil@brown.name>
+ */
+
+/*
+ * Decompress files compressed with gzip, xz or zstd.
+ *
+ * Patches are often stored compressed.  Rather than requiring them
+ * to be decompressed into a temporary file, any file that wiggle
+ * loads is checked for a known magic number and, if the matching
+ * library's header was found at build time, decompressed in memory.
+ * The Makefile defines HAVE_ZLIB, HAVE_LZMA and HAVE_ZSTD.
+ *
+ * wiggle is not linked against the libraries, as most runs never see
+ * a compressed file and shouldn't pay for loading them.  Instead the
+ * library is found with dlopen() when a file needs it.
+ */
+
+#include	"wiggle.h"
+#include	<stdlib.h>
+#include	<errno.h>
+#include	<limits.h>
+#include	<dlfcn.h>
+#ifdef HAVE_ZLIB
+#include	<zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include	<lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include	<zstd.h>
+#endif
+
+static struct {
+	char *name;
+	int len;
+	char *magic;
+	char *library;
+} formats[] = {
+	[COMPRESS_GZIP] = { "gzip", 2, "\x1f\x8b", "libz.so.1" },
+	[COMPRESS_XZ]   = { "xz", 6, "\xfd" "7zXZ\0", "liblzma.so.5" },
+	[COMPRESS_ZSTD] = { "zstd", 4, "\x28\xb5\x2f\xfd", "libzstd.so.1" },
+};
+
+/* The functions used from each library, found by load_library().
+ * inflateInit2() is a macro for inflateInit2_().
+ */
+#ifdef HAVE_ZLIB
+static struct {
+	__typeof__(inflateInit2_) *inflateInit2_;
+	__typeof__(inflate) *inflate;
+	__typeof__(inflateReset) *inflateReset;
+	__typeof__(inflateEnd) *inflateEnd;
+} zlib;
+#endif
+#ifdef HAVE_LZMA
+static struct {
+	__typeof__(lzma_stream_decoder) *lzma_stream_decoder;
+	__typeof__(lzma_code) *lzma_code;
+	__typeof__(lzma_end) *lzma_end;
+} lzma;
+#endif
+#ifdef HAVE_ZSTD
+static struct {
+	__typeof__(ZSTD_createDStream) *ZSTD_createDStream;
+	__typeof__(ZSTD_initDStream) *ZSTD_initDStream;
+	__typeof__(ZSTD_DStreamOutSize) *ZSTD_DStreamOutSize;
+	__typeof__(ZSTD_decompressStream) *ZSTD_decompressStream;
+	__typeof__(ZSTD_isError) *ZSTD_isError;
+	__typeof__(ZSTD_freeDStream) *ZSTD_freeDStream;
+} zstd;
+#endif
+
+#define FIND(h, lib, fn) ((lib.fn = dlsym(h, #fn)) != NULL)
+
+/* Load the library for format 'type' the first time it is needed.
+ * Returns 0, after reporting why, if it cannot be used.
+ */
+static int load_library(int type, char *name)
+{
+	static void *handle[sizeof(formats)/sizeof(formats[0])];
+	void *h = handle[type];
+	int ok = 0;
+
+	if (h)
+		return 1;
+	h = dlopen(formats[type].library, RTLD_NOW | RTLD_LOCAL);
+	if (!h) {
+		fprintf(stderr, "%s: %s is %s compressed, which is not supported without %s\n",
+			wiggle_Cmd, name, formats[type].name,
+			formats[type].library);
+		return 0;
+	}
+	switch (type) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		ok = FIND(h, zlib, inflateInit2_) && FIND(h, zlib, inflate) &&
+			FIND(h, zlib, inflateReset) &&
+			FIND(h, zlib, inflateEnd);
+		break;
+#endif
+#ifdef HAVE_LZMA
+	case COMPRESS_XZ:
+		ok = FIND(h, lzma, lzma_stream_decoder) &&
+			FIND(h, lzma, lzma_code) && FIND(h, lzma, lzma_end);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		ok = FIND(h, zstd, ZSTD_createDStream) &&
+			FIND(h, zstd, ZSTD_initDStream) &&
+			FIND(h, zstd, ZSTD_DStreamOutSize) &&
+			FIND(h, zstd, ZSTD_decompressStream) &&
+			FIND(h, zstd, ZSTD_isError) &&
+			FIND(h, zstd, ZSTD_freeDStream);
+		break;
+#endif
+	}
+	if (!ok) {
+		fprintf(stderr, "%s: %s is %s compressed, but %s is not usable\n",
+			wiggle_Cmd, name, formats[type].name,
+			formats[type].library);
+		dlclose(h);
+		return 0;
+	}
+	handle[type] = h;
+	return 1;
+}
+
+/* Return the COMPRESS_* type of the 'len' bytes at 'buf', or
+ * COMPRESS_NONE.  'len' only needs to be as long as the longest
+ * magic number.
+ */
+int wiggle_compressed(char *buf, int len)
+{
+	unsigned int i;
+
+	for (i = COMPRESS_NONE + 1; i < sizeof(formats)/sizeof(formats[0]); i++)
+		if (len >= formats[i].len &&
+		    memcmp(buf, formats[i].magic, formats[i].len) == 0)
+			return i;
+	return COMPRESS_NONE;
+}
+
+/* Could 'c' be the first byte of a compressed file? */
+int wiggle_maybe_compressed(int c)
+{
+	unsigned int i;
+
+	for (i = COMPRESS_NONE + 1; i < sizeof(formats)/sizeof(formats[0]); i++)
+		if ((unsigned char)formats[i].magic[0] == c)
+			return 1;
+	return 0;
+}
+
+/* A stream's length is an int, and the text needs room after it for
+ * the newline and nul that wiggle_load_file adds.
+ */
+#define MAX_SIZE ((size_t)INT_MAX)
+#define ROOM(out, size) ((size) - (out)->len - 2)
+
+/* Set when decompressed text would be too long for a stream */
+static int too_large;
+
+/* Make sure there is room for 'more' bytes after out->len, or as many
+ * as a stream can hold.  Returns 0 if there is no room at all.
+ */
+static int grow(struct stream *out, size_t *size, size_t more)
+{
+	size_t want = (size_t)out->len + more + 2;
+	size_t nsize = *size;
+
+	if (want <= *size)
+		return 1;
+	if (*size >= MAX_SIZE) {
+		if (ROOM(out, *size) > 0)
+			return 1;
+		too_large = 1;
+		return 0;
+	}
+	while (nsize < want && nsize < MAX_SIZE)
+		nsize = nsize > MAX_SIZE / 2 ? MAX_SIZE : nsize * 2;
+	out->body = realloc(out->body, nsize);
+	if (!out->body)
+		wiggle_die("memory allocation");
+	*size = nsize;
+	return 1;
+}
+
+#ifdef HAVE_ZLIB
+static int unzip(struct stream in, struct stream *out, size_t *size)
+{
+	z_stream z = {};
+	int ret;
+
+	/* 15+32 accepts either a gzip or a zlib header */
+	if (zlib.inflateInit2_(&z, 15 + 32, ZLIB_VERSION,
+				(int)sizeof(z)) != Z_OK)
+		return 0;
+	z.next_in = (unsigned char *)in.body;
+	z.avail_in = in.len;
+	do {
+		if (!grow(out, size, 65536))
+			break;
+		z.next_out = (unsigned char *)out->body + out->len;
+		z.avail_out = ROOM(out, *size);
+		ret = zlib.inflate(&z, Z_NO_FLUSH);
+		out->len = *size - 2 - z.avail_out;
+		/* "gzip a b > c" produces several members */
+		if (ret == Z_STREAM_END && z.avail_in > 0)
+			ret = zlib.inflateReset(&z);
+	} while (ret == Z_OK);
+	zlib.inflateEnd(&z);
+	return ret == Z_STREAM_END;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int unxz(struct stream in, struct stream *out, size_t *size)
+{
+	lzma_stream z = LZMA_STREAM_INIT;
+	lzma_ret ret;
+
+	if (lzma.lzma_stream_decoder(&z, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+		return 0;
+	z.next_in = (uint8_t *)in.body;
+	z.avail_in = in.len;
+	do {
+		if (!grow(out, size, 65536))
+			break;
+		z.next_out = (uint8_t *)out->body + out->len;
+		z.avail_out = ROOM(out, *size);
+		ret = lzma.lzma_code(&z, LZMA_FINISH);
+		out->len = *size - 2 - z.avail_out;
+	} while (ret == LZMA_OK);
+	lzma.lzma_end(&z);
+	return ret == LZMA_STREAM_END;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int unzstd(struct stream in, struct stream *out, size_t *size)
+{
+	ZSTD_DStream *z = zstd.ZSTD_createDStream();
+	ZSTD_inBuffer ib = { in.body, in.len, 0 };
+	size_t ret = 1;
+
+	if (!z)
+		return 0;
+	zstd.ZSTD_initDStream(z);
+	while (1) {
+		ZSTD_outBuffer ob;
+
+		if (!grow(out, size, zstd.ZSTD_DStreamOutSize())) {
+			ret = 1;
+			break;
+		}
+		ob.dst = out->body + out->len;
+		ob.size = ROOM(out, *size);
+		ob.pos = 0;
+		ret = zstd.ZSTD_decompressStream(z, &ob, &ib);
+		out->len += ob.pos;
+		if (zstd.ZSTD_isError(ret))
+			break;
+		/* With all the input used, a full buffer may mean that
+		 * decoded text is still held back, so ask again.
+		 */
+		if (ib.pos == ib.size && (ret == 0 || ob.pos < ob.size))
+			break;
+	}
+	zstd.ZSTD_freeDStream(z);
+	/* ret is 0 when the last frame was complete */
+	return ret == 0;
+}
+#endif
+
+/* If 's' holds compressed data, replace it with the decompressed
+ * text.  Returns 0 with errno set if it is compressed but cannot
+ * be decompressed, else 1.
+ */
+int wiggle_decompress(struct stream *s, char *name)
+{
+	int type = wiggle_compressed(s->body, s->len);
+	struct stream out;
+	size_t size;
+	int ok = 0;
+
+	if (type == COMPRESS_NONE)
+		return 1;
+
+	size = (size_t)s->len * 4 + 2;
+	if (size > MAX_SIZE)
+		size = MAX_SIZE;
+	too_large = 0;
+	out.body = wiggle_xmalloc(size);
+	out.len = 0;
+	switch (type) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		if (!load_library(type, name))
+			goto unusable;
+		ok = unzip(*s, &out, &size);
+		break;
+#endif
+#ifdef HAVE_LZMA
+	case COMPRESS_XZ:
+		if (!load_library(type, name))
+			goto unusable;
+		ok = unxz(*s, &out, &size);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		if (!load_library(type, name))
+			goto unusable;
+		ok = unzstd(*s, &out, &size);
+		break;
+#endif
+	default:
+		fprintf(stderr, "%s: %s is %s compressed, which is not supported by this build\n",
+			wiggle_Cmd, name, formats[type].name);
+		goto unusable;
+	}
+	if (!ok && too_large) {
+		fprintf(stderr, "%s: %s is too large once decompressed\n",
+			wiggle_Cmd, name);
+		free(out.body);
+		errno = EFBIG;
+		return 0;
+	}
+	if (!ok) {
+		fprintf(stderr, "%s: %s: bad %s data\n",
+			wiggle_Cmd, name, formats[type].name);
+		free(out.body);
+		errno = EINVAL;
+		return 0;
+	}
+	free(s->body);
+	*s = out;
+	return 1;
+unusable:
+	free(out.body);
+	errno = ENOTSUP;
+	return 0;
+}
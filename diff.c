@@ -130,8 +130,14 @@
 
 #include	"wiggle.h"
 #include	<stdlib.h>
+#include	<stdint.h>
 #include	<sys/time.h>
 
+static inline int min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
 struct v {
 	int x;	/* x location of furthest reaching path of current cost */
 	int md; /* diagonal location of midline crossing */
@@ -180,6 +186,7 @@ static int find_common(struct file *a, struct file *b,
 	int worst = (ahi-alo)+(bhi-blo);
 
 	int loopcount = -1;
+	int hurry;
 	shortcut = !!shortcut;
 	if (shortcut) {
 		char *lc = getenv("WIGGLE_LOOPCOUNT");
@@ -202,15 +209,22 @@ static int find_common(struct file *a, struct file *b,
 
 		if (loopcount > 0)
 			loopcount -= 1;
-		if (shortcut == 1 &&
+		hurry = wiggle_poll((khi - klo) / 2 + 1);
+		if (hurry == WIGGLE_CANCEL)
+			/* Pretend there are no more snakes */
+			return 0;
+		if (shortcut != 2 &&
 		    khi - klo > 5000 &&
-		    (loopcount == 0 ||
-		     (loopcount < 0 &&
-		      gettimeofday(&stop, NULL) == 0 &&
-		      (stop.tv_sec - start.tv_sec) * 1000000 +
-		      (stop.tv_usec - start.tv_usec) > 20000)))
+		    (hurry ||
+		     (shortcut == 1 &&
+		      (loopcount == 0 ||
+		       (loopcount < 0 &&
+			gettimeofday(&stop, NULL) == 0 &&
+			(stop.tv_sec - start.tv_sec) * 1000000 +
+			(stop.tv_usec - start.tv_usec) > 20000)))))
 			/* 20ms is a long time.  Time to take a shortcut
-			 * Next snake wins
+			 * Next snake wins.  Likewise if asked to hurry,
+			 * even when the shortest diff was wanted.
 			 */
 			shortcut = 2;
 		/* Find the longest snake extending on each current
@@ -366,8 +380,20 @@ struct cslb {
 	int		size;	/* How much is alloced */
 	int		len;	/* How much is used */
 	struct csl	*csl;
+	/* For wiggle_diff_stream(), runs that can no longer change
+	 * are passed to 'emit' and dropped from the buffer.
+	 * csl[0..mapped) has been remapped from af/bf to a/b,
+	 * and ta/tb are where remapping will continue from.
+	 */
+	void		(*emit)(void *data, struct csl *csl);
+	void		*data;
+	struct file	*a, *b, *af, *bf;
+	int		mapped;
+	int		ta, tb;
 };
 
+static void csl_flush(struct cslb *buf, int final);
+
 static void csl_add(struct cslb *buf, int a, int b, int len)
 {
 	struct csl *csl;
@@ -379,6 +405,8 @@ static void csl_add(struct cslb *buf, int a, int b, int len)
 			return;
 		}
 	}
+	if (buf->size <= buf->len && buf->emit)
+		csl_flush(buf, 0);
 	if (buf->size <= buf->len) {
 		if (buf->size < 64)
 			buf->size = 64;
@@ -442,6 +470,155 @@ static void lcsl(struct file *a, int alo, int ahi,
 	     cslb, v, shortcut);
 }
 
+/*
+ * Bit-parallel longest-common-sub-list for small ranges.
+ * wiggle_pdiff() calls wiggle_diff_partial() for a great many small
+ * regions, and for those the setup cost of find_common() dominates.
+ * When one side has at most BP_MAX tokens we can instead keep one
+ * bit per token of that side (the 'x' side) and process the other
+ * ('y') side a token at a time (Allison-Dix / Hyyro).
+ * After processing y[0..j), bit i of row[j] is clear iff the LCS
+ * of x[0..i] and y[0..j) is one longer than that of x[0..i) and
+ * y[0..j), so the LCS of any pair of prefixes is a count of clear
+ * bits.  Keeping every row lets us trace back the actual matches.
+ */
+#define BP_WORDS	4
+#define BP_MAX		(BP_WORDS * 64)
+#define BP_STACK	1024	/* rows kept on the stack */
+
+/* Number of clear bits below bit 'i' in 'row' */
+static inline int bp_lcs(uint64_t *row, int i)
+{
+	int n = 0, w = 0;
+
+	for (; i >= 64; i -= 64, w++)
+		n += 64 - __builtin_popcountll(row[w]);
+	if (i)
+		n += i - __builtin_popcountll(row[w] & ((1ULL << i) - 1));
+	return n;
+}
+
+/* Return 0 if the ranges are too big, so lcsl() must be used. */
+static int bp_lcsl(struct file *a, int alo, int ahi,
+		   struct file *b, int blo, int bhi,
+		   struct cslb *cslb)
+{
+	struct elmnt *x, *y;
+	int nx, ny, words, swap;
+	int slot[2 * BP_MAX];
+	int first[BP_MAX];
+	uint64_t mask[BP_MAX][BP_WORDS];
+	uint64_t stack[BP_STACK * BP_WORDS];
+	uint64_t *rows, *row;
+	int pairs[2 * BP_MAX];
+	int nslots, ndistinct = 0;
+	int i, j, k, w, np;
+
+	if (ahi - alo <= bhi - blo) {
+		x = a->list + alo; nx = ahi - alo;
+		y = b->list + blo; ny = bhi - blo;
+		swap = 0;
+	} else {
+		x = b->list + blo; nx = bhi - blo;
+		y = a->list + alo; ny = ahi - alo;
+		swap = 1;
+	}
+	if (nx > BP_MAX)
+		return 0;
+	if (nx == 0)
+		return 1;
+	words = (nx + 63) / 64;
+
+	/* A small open hash table maps each distinct x token to
+	 * the mask of places it appears.
+	 */
+	for (nslots = 16; nslots < 2 * nx; nslots *= 2)
+		;
+	for (k = 0; k < nslots; k++)
+		slot[k] = -1;
+	for (i = 0; i < nx; i++) {
+		for (k = x[i].hash & (nslots - 1);
+		     slot[k] >= 0 && !match(&x[first[slot[k]]], &x[i]);
+		     k = (k + 1) & (nslots - 1))
+			;
+		if (slot[k] < 0) {
+			slot[k] = ndistinct;
+			first[ndistinct] = i;
+			memset(mask[ndistinct], 0, sizeof(mask[0]));
+			ndistinct++;
+		}
+		mask[slot[k]][i / 64] |= 1ULL << (i % 64);
+	}
+
+	if (ny < BP_STACK)
+		rows = stack;
+	else
+		rows = wiggle_xmalloc((ny + 1) * words * sizeof(uint64_t));
+	for (w = 0; w < words; w++)
+		rows[w] = ~0ULL;
+	for (j = 0; j < ny; j++) {
+		uint64_t *v = rows + j * words;
+		uint64_t *m;
+		int carry = 0;
+
+		row = v + words;
+		for (k = y[j].hash & (nslots - 1);
+		     slot[k] >= 0 && !match(&x[first[slot[k]]], &y[j]);
+		     k = (k + 1) & (nslots - 1))
+			;
+		if (slot[k] < 0) {
+			/* Nothing in x matches, so nothing changes */
+			memcpy(row, v, words * sizeof(uint64_t));
+			continue;
+		}
+		m = mask[slot[k]];
+		for (w = 0; w < words; w++) {
+			uint64_t u = v[w] & m[w];
+			uint64_t s = v[w] + u + carry;
+
+			carry = s < v[w] || (carry && s == v[w]);
+			row[w] = s | (v[w] & ~m[w]);
+		}
+	}
+
+	/* Trace back from the end.  Where there is a choice, skip a
+	 * token from 'a' rather than from 'b', as that gives the same
+	 * answer as lcsl() in practice.
+	 */
+	i = nx; j = ny; np = 0;
+	while (i > 0 && j > 0) {
+		int l = bp_lcs(rows + j * words, i);
+		int skipx, skipy;
+
+		if (l == 0)
+			break;
+		skipx = bp_lcs(rows + j * words, i-1) == l;
+		skipy = bp_lcs(rows + (j-1) * words, i) == l;
+		if (swap ? skipy : skipx) {
+			if (swap)
+				j--;
+			else
+				i--;
+		} else if (skipx)
+			i--;
+		else if (skipy)
+			j--;
+		else {
+			i--; j--;
+			pairs[np++] = swap ? j : i;
+			pairs[np++] = swap ? i : j;
+		}
+	}
+	if (rows != stack)
+		free(rows);
+
+	while (np > 0) {
+		np -= 2;
+		csl_add(cslb, alo + pairs[np], blo + pairs[np+1], 1);
+	}
+	return 1;
+}
+
 /* If two common sequences are separated by only an add or remove,
  * and the first sequence ends the same as the middle text,
  * extend the second and contract the first in the hope that the
@@ -578,8 +755,8 @@ static int elcmp(const void *v1, const void *v2)
 			return -1;
 		return 1;
 	}
-	if (e1->start[0] == 0 && e2->start[0] == 0)
-		return 0;
+	if (e1->start[0] == 0 || e2->start[0] == 0)
+		return (e1->start[0] != 0) - (e2->start[0] != 0);
 	if (e1->len != e2->len)
 		return e1->len - e2->len;
 	return strncmp(e1->start, e2->start, e1->len);
@@ -625,6 +802,20 @@ static struct file filter_unique(struct file f, struct file ref)
 	return n;
 }
 
+/* Find the index in 'to' of from.list[fi], searching forward from *tip */
+static int remap_one(int fi, int *tip, struct file from, struct file to)
+{
+	int ti = *tip;
+
+	while (to.list[ti].start != from.list[fi].start) {
+		ti += 1;
+		if (ti > to.elcnt)
+			abort();
+	}
+	*tip = ti;
+	return ti;
+}
+
 static void remap(struct csl *csl, int which, struct file from, struct file to)
 {
 	/* The a,b pointer in csl points to 'from' we need to remap to 'to'.
@@ -633,16 +824,10 @@ static void remap(struct csl *csl, int which, struct file from, struct file to)
 	 */
 	int ti = 0;
 	while (csl->len) {
-		int fi = which ? csl->b : csl->a;
-		while (to.list[ti].start != from.list[fi].start) {
-			ti += 1;
-			if (ti > to.elcnt)
-				abort();
-		}
 		if (which)
-			csl->b = ti;
+			csl->b = remap_one(csl->b, &ti, from, to);
 		else
-			csl->a = ti;
+			csl->a = remap_one(csl->a, &ti, from, to);
 		csl += 1;
 	}
 	if (which)
@@ -650,39 +835,660 @@ static void remap(struct csl *csl, int which, struct file from, struct file to)
 	else
 		csl->a = to.elcnt;
 }
-/* Main entry point - find the common-sub-list of files 'a' and 'b'.
- * The final element in the list will have 'len' == 0 and will point
- * beyond the end of the files.
+
+/* Pass on any runs in 'buf' that fixup() can no longer change.
+ * fixup() only moves tokens between neighbouring runs which are
+ * separated on just one side, and only reaches back past a run
+ * when it removes that run completely - which leaves a gap that is
+ * the sum of the two it replaced.  So a run followed by a gap in both
+ * 'a' and 'b' is final, and everything up to it can be fixed-up
+ * on its own, with a zero-length run at the gap standing in for the
+ * end of the list.
+ * The last run in the buffer might still be extended by csl_add(),
+ * so it is left alone unless 'final'.
+ */
+static void csl_flush(struct cslb *buf, int final)
+{
+	struct csl *c = buf->csl;
+	int n = final ? buf->len : buf->len - 1;
+	struct csl save;
+	int i, k;
+
+	for (; buf->mapped < n; buf->mapped++) {
+		struct csl *m = &c[buf->mapped];
+		if (m->len == 0) {
+			m->a = buf->a->elcnt;
+			m->b = buf->b->elcnt;
+		} else {
+			m->a = remap_one(m->a, &buf->ta, *buf->af, *buf->a);
+			m->b = remap_one(m->b, &buf->tb, *buf->bf, *buf->b);
+		}
+	}
+	if (final) {
+		fixup(buf->a, buf->b, c);
+		for (i = 0; c[i].len; i++)
+			buf->emit(buf->data, &c[i]);
+		buf->emit(buf->data, &c[i]);
+		buf->len = buf->mapped = 0;
+		return;
+	}
+
+	for (k = buf->mapped - 2; k >= 0; k--)
+		if (c[k].a + c[k].len < c[k+1].a &&
+		    c[k].b + c[k].len < c[k+1].b)
+			break;
+	if (k < 0)
+		return;
+	save = c[k+1];
+	c[k+1].len = 0;
+	fixup(buf->a, buf->b, c);
+	for (i = 0; c[i].len; i++)
+		buf->emit(buf->data, &c[i]);
+	c[k+1] = save;
+	k += 1;
+	memmove(c, c + k, (buf->len - k) * sizeof(*c));
+	buf->len -= k;
+	buf->mapped -= k;
+}
+
+/*
+ * Patience diff.
+ * When there are many repeated tokens (braces, blank lines, 'return')
+ * the O(ND) search is slow and is likely to take its shortcut,
+ * which can align the wrong copies.  Tokens which occur exactly once
+ * in each file are much more reliable anchors.  We find all of those,
+ * keep the longest set that appear in the same order in both files,
+ * and then diff the gaps between them separately, recursively.  When
+ * a gap has no unique tokens we fall back to lcsl().
+ */
+struct uelmnt {
+	struct elmnt e;	/* must be first so elcmp() works */
+	int idx;
+};
+
+static int csl_cmp_a(const void *v1, const void *v2)
+{
+	const struct csl *c1 = v1, *c2 = v2;
+
+	return c1->a - c2->a;
+}
+
+static struct uelmnt *sort_range(struct file *f, int lo, int hi)
+{
+	struct uelmnt *u = wiggle_xmalloc(sizeof(*u) * (hi - lo));
+	int i;
+
+	for (i = lo; i < hi; i++) {
+		u[i-lo].e = f->list[i];
+		u[i-lo].idx = i;
+	}
+	qsort(u, hi - lo, sizeof(*u), elcmp);
+	return u;
+}
+
+/* Find tokens that are unique in both a[alo..ahi) and b[blo..bhi),
+ * and return the longest in-order subset as a list of single-token
+ * matches, ordered by 'a'.
+ * If 'lines_only', only tokens which end a line are considered.
  */
-struct csl *wiggle_diff(struct file a, struct file b, int shortest)
+static int find_anchors(struct file *a, int alo, int ahi,
+			struct file *b, int blo, int bhi,
+			struct csl **anchorsp, int lines_only)
+{
+	int na = ahi - alo, nb = bhi - blo;
+	struct uelmnt *sa = sort_range(a, alo, ahi);
+	struct uelmnt *sb = sort_range(b, blo, bhi);
+	struct csl *pairs;
+	int *tails, *prev;
+	int i, j, np = 0, len = 0;
+
+	pairs = wiggle_xmalloc(sizeof(*pairs) * (min(na, nb) + 1));
+	i = j = 0;
+	while (i < na && j < nb) {
+		int i2 = i+1, j2 = j+1;
+		int c = elcmp(&sa[i], &sb[j]);
+
+		if (c < 0) {
+			while (i2 < na && elcmp(&sa[i], &sa[i2]) == 0)
+				i2++;
+			i = i2;
+			continue;
+		}
+		if (c > 0) {
+			while (j2 < nb && elcmp(&sb[j], &sb[j2]) == 0)
+				j2++;
+			j = j2;
+			continue;
+		}
+		while (i2 < na && elcmp(&sa[i], &sa[i2]) == 0)
+			i2++;
+		while (j2 < nb && elcmp(&sb[j], &sb[j2]) == 0)
+			j2++;
+		if (i2 == i+1 && j2 == j+1 &&
+		    (!lines_only || ends_line(sa[i].e))) {
+			pairs[np].a = sa[i].idx;
+			pairs[np].b = sb[j].idx;
+			pairs[np].len = 1;
+			np++;
+		}
+		i = i2;
+		j = j2;
+	}
+	free(sa);
+	free(sb);
+	qsort(pairs, np, sizeof(*pairs), csl_cmp_a);
+
+	/* Longest increasing subsequence of 'b' by patience sorting.
+	 * tails[l] is the pair ending the best sequence of length l+1,
+	 * prev[p] is the pair before 'p' in its sequence.
+	 */
+	tails = wiggle_xmalloc(sizeof(int) * (np + 1));
+	prev = wiggle_xmalloc(sizeof(int) * (np + 1));
+	for (i = 0; i < np; i++) {
+		int lo = 0, hi = len;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (pairs[tails[mid]].b < pairs[i].b)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		prev[i] = lo ? tails[lo-1] : -1;
+		tails[lo] = i;
+		if (lo == len)
+			len++;
+	}
+	*anchorsp = wiggle_xmalloc(sizeof(struct csl) * (len + 1));
+	for (i = len ? tails[len-1] : -1, j = len; i >= 0; i = prev[i])
+		(*anchorsp)[--j] = pairs[i];
+	free(tails);
+	free(prev);
+	free(pairs);
+	return len;
+}
+
+static void patience(struct file *a, int alo, int ahi,
+		     struct file *b, int blo, int bhi,
+		     struct cslb *cslb,
+		     struct v *v, int shortcut)
+{
+	struct csl *anchors;
+	int n, i;
+	int tail = 0;
+	int pa, pb;
+
+	/* Common prefix and suffix can be taken as they are */
+	while (alo < ahi && blo < bhi &&
+	       match(&a->list[alo], &b->list[blo])) {
+		csl_add(cslb, alo, blo, 1);
+		alo++;
+		blo++;
+	}
+	while (ahi > alo && bhi > blo &&
+	       match(&a->list[ahi-1], &b->list[bhi-1])) {
+		ahi--;
+		bhi--;
+		tail++;
+	}
+
+	if (ahi > alo && bhi > blo) {
+		n = find_anchors(a, alo, ahi, b, blo, bhi, &anchors, 0);
+		if (n == 0)
+			lcsl(a, alo, ahi, b, blo, bhi, cslb, v, shortcut);
+		pa = alo;
+		pb = blo;
+		for (i = 0; i < n; i++) {
+			patience(a, pa, anchors[i].a, b, pb, anchors[i].b,
+				 cslb, v, shortcut);
+			csl_add(cslb, anchors[i].a, anchors[i].b, 1);
+			pa = anchors[i].a + 1;
+			pb = anchors[i].b + 1;
+		}
+		if (n)
+			patience(a, pa, ahi, b, pb, bhi, cslb, v, shortcut);
+		free(anchors);
+	}
+	if (tail)
+		csl_add(cslb, ahi, bhi, tail);
+}
+
+/* When the files are large, a single lcsl() over the whole of them
+ * can take a very long time even when they share thousands of
+ * lines which obviously line up.  So first find the lines which
+ * occur exactly once in each file and in the same order, and treat
+ * the regions between them as independent problems.
+ * Unique words are not used: they are much less reliable anchors
+ * than unique lines.
+ */
+#define ANCHOR_MIN	20000
+
+static void anchored_lcsl(struct file *a, int alo, int ahi,
+			  struct file *b, int blo, int bhi,
+			  struct cslb *cslb,
+			  struct v *v, int shortcut)
+{
+	struct csl *anchors;
+	int n, i;
+	int pa = alo, pb = blo;
+
+	n = find_anchors(a, alo, ahi, b, blo, bhi, &anchors, 1);
+	for (i = 0; i < n; i++) {
+		lcsl(a, pa, anchors[i].a, b, pb, anchors[i].b,
+		     cslb, v, shortcut);
+		csl_add(cslb, anchors[i].a, anchors[i].b, 1);
+		pa = anchors[i].a + 1;
+		pb = anchors[i].b + 1;
+	}
+	lcsl(a, pa, ahi, b, pb, bhi, cslb, v, shortcut);
+	free(anchors);
+}
+
+/*
+ * For very large files with many changes even anchored_lcsl() can
+ * take minutes in word mode.  Lining up whole lines first is much
+ * cheaper as there are several times fewer of them, and the words
+ * then only need to be compared within the regions between common
+ * lines.  The result is not always the shortest word diff, so
+ * wiggle_plan() only chooses this when the word diff would be slow.
+ */
+/* Group the words of f from lo to hi into lines.  Each line's hash
+ * combines the hashes of its words and its len is the number of
+ * words, so lines which match almost certainly have matching words.
+ * first[] gets the index of each line's first word, with first[n]
+ * being 'hi'.
+ */
+static struct file group_lines(struct file *f, int lo, int hi, int **firstp)
+{
+	struct file l;
+	int *first;
+	int i, n = 0;
+
+	for (i = lo; i < hi; i++)
+		if (ends_line(f->list[i]) || i == hi - 1)
+			n++;
+	l.list = wiggle_xmalloc(sizeof(l.list[0]) * (n + 1));
+	first = wiggle_xmalloc(sizeof(first[0]) * (n + 1));
+	l.elcnt = 0;
+	for (i = lo; i < hi; i++) {
+		struct elmnt *e = &l.list[l.elcnt];
+
+		if (i == lo || ends_line(f->list[i-1])) {
+			first[l.elcnt] = i;
+			e->start = f->list[i].start;
+			e->hash = 0;
+			e->len = 0;
+			e->plen = e->prefix = 0;
+		}
+		e->hash = (e->hash ^ f->list[i].hash) * 0xbf58476d1ce4e5b9ULL;
+		e->hash ^= e->hash >> 31;
+		if (e->len < 32767)
+			e->len++;
+		if (ends_line(f->list[i]) || i == hi - 1)
+			l.elcnt++;
+	}
+	first[l.elcnt] = hi;
+	*firstp = first;
+	return l;
+}
+
+/* Words which are not in lines that line up */
+static void lines_first_gap(struct file *a, int alo, int ahi,
+			    struct file *b, int blo, int bhi,
+			    struct cslb *cslb, struct v *v, int shortcut)
+{
+	if (!bp_lcsl(a, alo, ahi, b, blo, bhi, cslb))
+		lcsl(a, alo, ahi, b, blo, bhi, cslb, v, shortcut);
+}
+
+static void lines_first(struct file *a, int alo, int ahi,
+			struct file *b, int blo, int bhi,
+			struct cslb *cslb,
+			struct v *v, int shortcut)
+{
+	struct file la, lb;
+	int *fa, *fb;
+	struct cslb lc = {};
+	struct v *lv;
+	int i, k;
+	int pa = alo, pb = blo;
+
+	la = group_lines(a, alo, ahi, &fa);
+	lb = group_lines(b, blo, bhi, &fb);
+	lv = wiggle_xmalloc(sizeof(struct v) * (la.elcnt + lb.elcnt + 2));
+	lv += lb.elcnt + 1;
+	lcsl(&la, 0, la.elcnt, &lb, 0, lb.elcnt, &lc, lv, shortcut);
+	free(lv - (lb.elcnt + 1));
+
+	for (i = 0; i < lc.len; i++) {
+		int xa = lc.csl[i].a, xb = lc.csl[i].b, n = lc.csl[i].len;
+
+		for (k = 0; k < n; k++) {
+			int wa = fa[xa + k], wb = fb[xb + k];
+			int cnt = fa[xa + k + 1] - wa;
+			int j = -1;
+
+			if (cnt == fb[xb + k + 1] - wb)
+				for (j = 0; j < cnt; j++)
+					if (!match(&a->list[wa + j],
+						   &b->list[wb + j]))
+						break;
+			if (j == cnt) {
+				/* The line really does match */
+				lines_first_gap(a, pa, wa, b, pb, wb,
+						cslb, v, shortcut);
+				csl_add(cslb, wa, wb, cnt);
+				pa = wa + cnt;
+				pb = wb + cnt;
+			}
+		}
+	}
+	lines_first_gap(a, pa, ahi, b, pb, bhi, cslb, v, shortcut);
+	free(lc.csl);
+	free(la.list);
+	free(lb.list);
+	free(fa);
+	free(fb);
+}
+
+/* An upper bound on the memory wiggle_diff() needs for files of
+ * 'a' and 'b' elements: the filtered copies of both, the 'v' array
+ * and the csl.
+ */
+long wiggle_diff_cost(int a, int b)
+{
+	return (long)(a + b) * sizeof(struct elmnt) +
+		(long)(a + b + 2) * sizeof(struct v) +
+		(long)(min(a, b) + 2) * sizeof(struct csl);
+}
+
+/*
+ * Choosing how to diff.
+ * Myers' algorithm, as used by lcsl(), takes about (N+M)*D steps for
+ * N and M elements with D differences.  D is estimated from the
+ * lines which are in one file but not the other, scaled by the
+ * number of elements per line.  When lining up lines first, the
+ * lines take the same number of steps, but each is slower, and then
+ * only the words in the regions between common lines are compared.
+ * That is about the square of the fraction of lines which changed
+ * of the word steps, as changed lines cluster together.
+ *
+ * The time per step was fitted with WIGGLE_TRACE, which reports the
+ * estimate and the time actually taken, over tests/contrib/series and
+ * 60000 lines of C headers with 1% and 20% of lines changed.  The
+ * ranking of the plans was right in each case, though the estimates
+ * are only good to a factor of two or three.
+ *
+ * The first of plans[] which is expected to take less than
+ * PLAN_BUDGET milliseconds is used, or else the quickest.
+ *
+ * Files with more than PLAN_WHOLE_WORDS words have always been split
+ * into whole words, so only plans which do that are considered for
+ * them, however quick the estimate says a finer diff would be.
+ */
+#define PLAN_WORD_PS	70	/* picoseconds per step by word */
+#define PLAN_LINE_PS	2000	/* and by line */
+#define PLAN_BUDGET	500
+#define PLAN_WHOLE_WORDS 50000
+
+static struct plan {
+	int type, flags;
+	char *name;
+} plans[] = {
+	{ 0, 0, "by word" },
+	{ WholeWord, 0, "by whole word" },
+	{ 0, DiffLinesFirst, "lines first" },
+	{ WholeWord, DiffLinesFirst, "whole words, lines first" },
+};
+
+struct line_counts {
+	int lines;	/* in both files */
+	int changed;	/* lines in one file but not the other */
+};
+
+struct line_slot {
+	uint64_t hash;
+	int count;
+};
+
+static struct line_slot *line_slot(struct line_slot *tab, int size,
+				   char *start, int len)
+{
+	uint64_t h = wiggle_hash(start, len) | 1;
+	int i;
+
+	for (i = h & (size - 1);
+	     tab[i].hash && tab[i].hash != h;
+	     i = (i + 1) & (size - 1))
+		;
+	tab[i].hash = h;
+	return &tab[i];
+}
+
+/* The length of the line in 's' that starts at 'c' */
+static int line_len(struct stream s, char *c)
+{
+	char *nl = memchr(c, '\n', s.body + s.len - c);
+
+	return nl ? nl - c + 1 : s.body + s.len - c;
+}
+
+static void count_lines(struct stream a, struct stream b,
+			struct line_counts *lc)
+{
+	struct line_slot *tab;
+	int size = 16;
+	char *c;
+	int i, len;
+
+	memset(lc, 0, sizeof(*lc));
+	if (!a.body || !b.body)
+		return;
+	for (c = b.body; c < b.body + b.len; c += line_len(b, c))
+		lc->lines++;
+	for (c = a.body; c < a.body + a.len; c += line_len(a, c))
+		lc->lines++;
+	/* Lines of 'a' which aren't in 'b' take a slot too */
+	while (size < 2 * lc->lines)
+		size *= 2;
+	tab = wiggle_xmalloc(sizeof(*tab) * size);
+	memset(tab, 0, sizeof(*tab) * size);
+	for (c = b.body; c < b.body + b.len; c += len) {
+		len = line_len(b, c);
+		line_slot(tab, size, c, len)->count++;
+	}
+	for (c = a.body; c < a.body + a.len; c += len) {
+		struct line_slot *ls;
+
+		len = line_len(a, c);
+		ls = line_slot(tab, size, c, len);
+		if (ls->count > 0)
+			ls->count--;
+		else
+			lc->changed++;
+	}
+	for (i = 0; i < size; i++)
+		lc->changed += tab[i].count;
+	free(tab);
+}
+
+/* Estimated milliseconds for wiggle_diff(), or wiggle_pdiff() if 'chunks' */
+static long diff_ms(int na, int nb, struct line_counts *lc,
+		    int flags, int chunks)
+{
+	long n = (long)na + nb;
+	long lines = lc->lines ? lc->lines : 1;
+	long d = lc->changed * n / lines + 1;
+	long ps;
+
+	if (chunks)
+		/* find_best() looks for each hunk across the file */
+		ps = n * (nb / chunks + 1) * PLAN_WORD_PS;
+	else
+		ps = n * d * PLAN_WORD_PS;
+	if (flags & DiffLinesFirst)
+		ps = ps / lines * lc->changed / lines * lc->changed +
+			lines * (lc->changed + 1) * PLAN_LINE_PS;
+	return ps / 1000000000;
+}
+
+/*
+ * Choose how to split and diff the streams for a merge, or for a
+ * diff if s[2].body is NULL.  'type' and 'flags' are what the caller
+ * would use, and may have WholeWord or DiffLinesFirst added.
+ * 'chunks' is the number of hunks if s[1] is from a patch.
+ */
+void wiggle_plan(struct stream s[3], int *type, int *flags, int chunks)
+{
+	struct line_counts lc1, lc2;
+	long bytes = (long)s[0].len + s[1].len;
+	long est[sizeof(plans) / sizeof(plans[0])];
+	int i, best = -1;
+	int whole = 0;
+
+	if ((*type & ByMask) != ByWord || (*type & WholeWord) ||
+	    (*flags & DiffPatience))
+		return;
+	if (s[2].body && (long)s[2].len > s[0].len)
+		bytes = (long)s[1].len + s[2].len;
+	if (s[1].len > PLAN_WHOLE_WORDS &&
+	    wiggle_count_stream(s[1], *type) > PLAN_WHOLE_WORDS &&
+	    (wiggle_count_stream(s[0], *type) > PLAN_WHOLE_WORDS ||
+	     wiggle_count_stream(s[2], *type) > PLAN_WHOLE_WORDS))
+		whole = WholeWord;
+	/* Words can't outnumber bytes */
+	if (bytes * bytes / 1000000 * PLAN_WORD_PS / 1000 <= PLAN_BUDGET) {
+		*type |= whole;
+		return;
+	}
+
+	count_lines(s[0], s[1], &lc1);
+	count_lines(s[1], s[2], &lc2);
+	for (i = 0; i < (int)(sizeof(plans) / sizeof(plans[0])); i++) {
+		int t = *type | plans[i].type;
+		int f = *flags | plans[i].flags;
+		int n0, n1, n2;
+
+		est[i] = -1;
+		if (chunks && (f & DiffLinesFirst))
+			/* wiggle_pdiff() doesn't do that */
+			continue;
+		if (whole && !(t & WholeWord))
+			continue;
+		n0 = wiggle_count_stream(s[0], t);
+		n1 = wiggle_count_stream(s[1], t);
+		n2 = wiggle_count_stream(s[2], t);
+		est[i] = diff_ms(n0, n1, &lc1, f, chunks);
+		if (s[2].body && !chunks)
+			est[i] += diff_ms(n1, n2, &lc2, f, 0);
+		if (best < 0 ||
+		    (est[best] > PLAN_BUDGET && est[i] < est[best]))
+			best = i;
+	}
+	*type |= plans[best].type;
+	*flags |= plans[best].flags;
+	if (wiggle_trace_file) {
+		wiggle_trace_event("plan");
+		fprintf(wiggle_trace_file,
+			",\"lines\":%d,\"changed\":%d,"
+			"\"hunks\":%d,\"estimates\":{",
+			lc1.lines, lc1.changed, chunks);
+		for (i = 0; i < (int)(sizeof(plans) / sizeof(plans[0])); i++)
+			if (est[i] >= 0)
+				fprintf(wiggle_trace_file, "%s\"%s\":%ld",
+					i ? "," : "", plans[i].name, est[i]);
+		fprintf(wiggle_trace_file, "},\"using\":\"%s\"}\n",
+			plans[best].name);
+	}
+	if (!wiggle_do_trace)
+		return;
+	fprintf(stderr, "%s: plan: %d lines, %d changed:", wiggle_Cmd,
+		lc1.lines, lc1.changed);
+	for (i = 0; i < (int)(sizeof(plans) / sizeof(plans[0])); i++)
+		if (est[i] >= 0)
+			fprintf(stderr, " %s ~%ldms,", plans[i].name, est[i]);
+	fprintf(stderr, " using %s\n", plans[best].name);
+}
+
+static void run_diff(struct file *a, struct file *b, int flags,
+		     struct cslb *cslb)
 {
 	struct v *v;
-	struct cslb cslb = {};
 	struct file af, bf;
 
 	/* Remove runs of 2 or more elements in one file that don't
 	 * exist in the other file.  This often makes the number of
 	 * elements more manageable.
 	 */
-	af = filter_unique(a, b);
-	bf = filter_unique(b, a);
+	af = filter_unique(*a, *b);
+	bf = filter_unique(*b, *a);
+	cslb->a = a;
+	cslb->b = b;
+	cslb->af = &af;
+	cslb->bf = &bf;
 
 	v = wiggle_xmalloc(sizeof(struct v)*(af.elcnt+bf.elcnt+2));
 	v += bf.elcnt+1;
 
-	lcsl(&af, 0, af.elcnt,
-	     &bf, 0, bf.elcnt,
-	     &cslb, v, !shortest);
-	csl_add(&cslb, af.elcnt, bf.elcnt, 0);
+	if (flags & DiffPatience)
+		patience(&af, 0, af.elcnt,
+			 &bf, 0, bf.elcnt,
+			 cslb, v, !(flags & DiffShortest));
+	else if (flags & DiffLinesFirst)
+		lines_first(&af, 0, af.elcnt,
+			    &bf, 0, bf.elcnt,
+			    cslb, v, !(flags & DiffShortest));
+	else if (!(flags & DiffShortest) &&
+		 af.elcnt + bf.elcnt >= ANCHOR_MIN)
+		anchored_lcsl(&af, 0, af.elcnt,
+			      &bf, 0, bf.elcnt,
+			      cslb, v, 1);
+	else
+		lcsl(&af, 0, af.elcnt,
+		     &bf, 0, bf.elcnt,
+		     cslb, v, !(flags & DiffShortest));
+	csl_add(cslb, af.elcnt, bf.elcnt, 0);
 	free(v-(bf.elcnt+1));
-	remap(cslb.csl, 0, af, a);
-	remap(cslb.csl, 1, bf, b);
+	if (cslb->emit)
+		csl_flush(cslb, 1);
+	else {
+		remap(cslb->csl, 0, af, *a);
+		remap(cslb->csl, 1, bf, *b);
+		fixup(a, b, cslb->csl);
+	}
 	free(af.list);
 	free(bf.list);
-	fixup(&a, &b, cslb.csl);
+}
+
+/* Main entry point - find the common-sub-list of files 'a' and 'b'.
+ * The final element in the list will have 'len' == 0 and will point
+ * beyond the end of the files.
+ * 'flags' can contain DiffShortest and DiffPatience.
+ * Without either, large files are first split at unique anchors.
+ */
+struct csl *wiggle_diff(struct file a, struct file b, int flags)
+{
+	struct cslb cslb = {};
+
+	run_diff(&a, &b, flags, &cslb);
 	return cslb.csl;
 }
 
+/* As wiggle_diff(), but rather than returning the whole list, pass
+ * each entry to 'emit' as soon as it is known to be final.
+ * The last entry passed is the one with 'len' == 0.
+ */
+void wiggle_diff_stream(struct file a, struct file b, int flags,
+			void (*emit)(void *data, struct csl *csl),
+			void *data)
+{
+	struct cslb cslb = {};
+
+	cslb.emit = emit;
+	cslb.data = data;
+	run_diff(&a, &b, flags, &cslb);
+	free(cslb.csl);
+}
+
 /* Alternate entry point - find the common-sub-list in two
  * subranges of files.
  */
@@ -691,14 +1497,17 @@ struct csl *wiggle_diff_partial(struct file a, struct file b,
 {
 	struct v *v;
 	struct cslb cslb = {};
-	v = wiggle_xmalloc(sizeof(struct v)*(ahi-alo+bhi-blo+2));
-	v += bhi-alo+1;
 
-	lcsl(&a, alo, ahi,
-	     &b, blo, bhi,
-	     &cslb, v, 0);
+	if (!bp_lcsl(&a, alo, ahi, &b, blo, bhi, &cslb)) {
+		v = wiggle_xmalloc(sizeof(struct v)*(ahi-alo+bhi-blo+2));
+		v += bhi-alo+1;
+
+		lcsl(&a, alo, ahi,
+		     &b, blo, bhi,
+		     &cslb, v, 0);
+		free(v-(bhi-alo+1));
+	}
 	csl_add(&cslb, ahi, bhi, 0);
-	free(v-(bhi-alo+1));
 	fixup(&a, &b, cslb.csl);
 	return cslb.csl;
 }
@@ -737,7 +1546,7 @@ struct csl *wiggle_csl_join(struct csl *c1, struct csl *c2)
  * line up.  So don't do a full diff, but rather find the hunk
  * headers and diff the bits between them.
  */
-struct csl *wiggle_diff_patch(struct file a, struct file b, int shortest)
+struct csl *wiggle_diff_patch(struct file a, struct file b, int flags)
 {
 	int ap, bp;
 	struct csl *csl = NULL;
@@ -745,7 +1554,7 @@ struct csl *wiggle_diff_patch(struct file a, struct file b, int shortest)
 	    a.list[0].start[0] != '\0' ||
 	    b.list[0].start[0] != '\0')
 		/* this is not a patch */
-		return wiggle_diff(a, b, shortest);
+		return wiggle_diff(a, b, flags);
 
 	ap = 0; bp = 0;
 	while (ap < a.elcnt && bp < b.elcnt) {
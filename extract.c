@@ -27,200 +27,433 @@
  * split patch or merge files.
  */
 
+#define _GNU_SOURCE /* for getline and memmem */
 #include	"wiggle.h"
 #include	<stdlib.h>
 
 /* skip 'cp' past the new '\n', or all the way to 'end' */
 static void skip_eol(char **cp, char *end)
+{
+	char *c = memchr(*cp, '\n', end - *cp);
+
+	*cp = c ? c + 1 : end;
+}
+
+static void skip_blanks(char **cp, char *end)
 {
 	char *c = *cp;
-	while (c < end && *c != '\n')
+
+	while (c < end && (*c == ' ' || *c == '\t'))
 		c++;
-	if (c < end)
+	*cp = c;
+}
+
+/* Parse a decimal number as "%d" would, but stopping at 'end' */
+static int get_num(char **cp, char *end, int *val)
+{
+	char *c = *cp;
+	int neg = 0, n = 0;
+
+	skip_blanks(&c, end);
+	if (c < end && (*c == '-' || *c == '+'))
+		neg = *c++ == '-';
+	if (c >= end || *c < '0' || *c > '9')
+		return 0;
+	while (c < end && *c >= '0' && *c <= '9')
+		n = n * 10 + *c++ - '0';
+	*val = neg ? -n : n;
+	*cp = c;
+	return 1;
+}
+
+/* Parse "start,len" or "start" from a unified hunk header, then
+ * skip anything else up to the next space.
+ */
+static int get_range(char **cp, char *end, int *start, int *len, int *cnt)
+{
+	char *c = *cp;
+
+	if (!get_num(&c, end, start))
+		return 0;
+	if (c < end && *c == ',' && (c++, get_num(&c, end, len)))
+		*cnt = *len;
+	else
+		*cnt = 1;
+	while (c < end && *c != ' ' && *c != '\t' && *c != '\n')
 		c++;
 	*cp = c;
+	return 1;
+}
+
+/* Parse "first,last" following 'prefix' in a context hunk header */
+static int get_context(char *cp, char *end, char *prefix,
+		       int *first, int *last)
+{
+	if (end - cp < 3 || strncmp(cp, prefix, 3) != 0)
+		return 0;
+	cp += 3;
+	return get_num(&cp, end, first) &&
+		cp < end && *cp++ == ',' &&
+		get_num(&cp, end, last);
+}
+
+/* Copy the rest of the line to 'func' if it isn't empty */
+static void get_func(char *cp, char *end, char func[100])
+{
+	int n = 0;
+
+	while (cp < end && *cp != '\n' && *cp && n < 99)
+		func[n++] = *cp++;
+	if (n)
+		func[n] = 0;
 }
 
-/* copy one line, or to end, from 'cp' into the stream, extending
- * the stream.
+/* Extracted text is either appended to a stream which has been
+ * allocated large enough, written straight out to a file, or
+ * (if neither is set) discarded.
  */
-static void copyline(struct stream *s, char **cp, char *end)
+struct xout {
+	struct stream *s;
+	FILE *f;
+};
+
+static void put(struct xout *o, char *text, int len)
+{
+	if (o->s) {
+		memcpy(o->s->body + o->s->len, text, len);
+		o->s->len += len;
+	} else if (o->f)
+		fwrite(text, 1, len, o->f);
+}
+
+/* copy one line, or to end, from 'cp' to 'o' */
+static void copyline(struct xout *o, char **cp, char *end)
 {
 	char *from = *cp;
-	char *to = s->body+s->len;
-
-	while (from < end && *from != '\n')
-		*to++ = *from++;
-	if (from < end)
-		*to++ = *from++;
-	s->len = to-s->body;
-	*cp = from;
+
+	skip_eol(cp, end);
+	put(o, from, *cp - from);
+}
+
+/* Both the patch and merge parsers below look at one line at a time,
+ * so they can work on a file in memory or a line at a time from a pipe.
+ * 'cp' is the start of the line and 'end' is the end of the data
+ * available, which is at least the end of the line.
+ */
+struct patch_state {
+	/* state:
+	 *   0   not in a patch
+	 *   1   first half of context
+	 *   2   second half of context
+	 *   3   unified
+	 */
+	int state;
+	int chunks;
+	int acnt, bcnt;
+	int a, b, c, d;
+	int lineno;
+	char func[100];
+};
+
+/* Returns 0 on success or -1 if the patch is malformed */
+static int patch_line(struct patch_state *ps, char *cp, char *end,
+		      struct xout out[2])
+{
+	char *cp2;
+
+	ps->lineno++;
+	switch (ps->state) {
+	case 0:
+		/* Only lines starting '@', '*' or '-' can be headers */
+		if (*cp == '@') {
+			char *c = cp + 4;
+
+			if (end - cp >= 4 && strncmp(cp, "@@ -", 4) == 0 &&
+			    get_range(&c, end, &ps->a, &ps->b, &ps->acnt) &&
+			    (skip_blanks(&c, end), c < end && *c++ == '+') &&
+			    get_range(&c, end, &ps->c, &ps->d, &ps->bcnt)) {
+				skip_blanks(&c, end);
+				if (end - c >= 2 && c[0] == '@' && c[1] == '@')
+					get_func(c+2, end, ps->func);
+				ps->state = 3;
+			}
+		} else if (*cp == '*') {
+			if (get_context(cp, end, "***", &ps->a, &ps->b)) {
+				ps->acnt = ps->b-ps->a+1;
+				ps->state = 1;
+			} else if (end - cp >= 15 &&
+				   strncmp(cp, "***************", 15) == 0)
+				get_func(cp+15, end, ps->func);
+		} else if (*cp == '-') {
+			if (get_context(cp, end, "---", &ps->c, &ps->d)) {
+				ps->bcnt = ps->d-ps->c+1;
+				ps->state = 2;
+			}
+		}
+
+		if (ps->state == 1 || ps->state == 3) {
+			char *f;
+			int slen;
+			/* Reserve enough space for 3 integers separated
+			 * by a single space, prefixed with a null character,
+			 * then the function name, newline and null.
+			 */
+			char buf[(3*12)+1+sizeof(ps->func)+2];
+			buf[0] = 0;
+			ps->chunks++;
+			slen = sprintf(buf+1, "%5d %5d %5d", ps->chunks,
+				       ps->a, ps->acnt)+1;
+			f = ps->func;
+			while (*f == ' ')
+				f++;
+			if (*f) {
+				buf[slen++] = ' ';
+				strcpy(buf + slen, f);
+				slen += strlen(f);
+			}
+			buf[slen++] = '\n';
+			buf[slen++] = '\0';
+			put(&out[0], buf, slen);
+		}
+		if (ps->state == 2 || ps->state == 3) {
+			int slen;
+			/* Reserve enough space for 3 integers separated
+			 * by a single space, prefixed with a null character
+			 * and terminated with a new line and null character.
+			 */
+			char buf[(3*12)+2];
+			buf[0] = 0;
+			slen = sprintf(buf+1, "%5d %5d %5d\n", ps->chunks,
+				       ps->c, ps->bcnt)+2;
+			put(&out[1], buf, slen);
+		}
+		if (ps->state)
+			ps->func[0] = 0;
+		break;
+	case 1:
+		if ((*cp == ' ' || *cp == '!' || *cp == '-' || *cp == '+')
+		    && cp[1] == ' ') {
+			cp += 2;
+			copyline(&out[0], &cp, end);
+			ps->acnt--;
+			if (ps->acnt == 0)
+				ps->state = 0;
+		} else {
+			fprintf(stderr, "%s: bad context patch at line %d\n",
+				wiggle_Cmd, ps->lineno);
+			return -1;
+		}
+		break;
+	case 2:
+		if ((*cp == ' ' || *cp == '!' || *cp == '-' || *cp == '+')
+		    && cp[1] == ' ') {
+			cp += 2;
+			copyline(&out[1], &cp, end);
+			ps->bcnt--;
+			if (ps->bcnt == 0)
+				ps->state = 0;
+		} else {
+			fprintf(stderr, "%s: bad context patch/2 at line %d\n",
+				wiggle_Cmd, ps->lineno);
+			return -1;
+		}
+		break;
+	case 3:
+		if (*cp == ' ') {
+			cp++;
+			cp2 = cp;
+			copyline(&out[0], &cp, end);
+			copyline(&out[1], &cp2, end);
+			ps->acnt--; ps->bcnt--;
+		} else if (*cp == '-') {
+			cp++;
+			copyline(&out[0], &cp, end);
+			ps->acnt--;
+		} else if (*cp == '+') {
+			cp++;
+			copyline(&out[1], &cp, end);
+			ps->bcnt--;
+		} else if (*cp == '\n') {
+			/* Empty line - treat like " \n" - a blank line in both */
+			cp2 = cp;
+			copyline(&out[0], &cp, end);
+			copyline(&out[1], &cp2, end);
+			ps->acnt --; ps->bcnt--;
+		} else {
+			fprintf(stderr, "%s: bad unified patch at line %d\n",
+				wiggle_Cmd, ps->lineno);
+			return -1;
+		}
+		if (ps->acnt <= 0 && ps->bcnt <= 0)
+			ps->state = 0;
+		break;
+	}
+	return 0;
 }
 
 int wiggle_split_patch(struct stream f, struct stream *f1, struct stream *f2)
 {
 	struct stream r1, r2;
-	int chunks = 0;
+	struct xout out[2] = { {&r1, NULL}, {&r2, NULL} };
+	struct patch_state ps = {};
 	char *cp, *end;
-	int state = 0;
-	int acnt = 0, bcnt = 0;
-	int a, b, c, d;
-	int lineno = 0;
-	char before[100], after[100];
-	char func[100];
 
 	f1->body = f2->body = NULL;
 
 	r1.body = wiggle_xmalloc(f.len);
 	r2.body = wiggle_xmalloc(f.len);
 	r1.len = r2.len = 0;
-	func[0] = 0;
 
 	cp = f.body;
 	end = f.body+f.len;
 	while (cp < end) {
-		/* state:
-		 *   0   not in a patch
-		 *   1   first half of context
-		 *   2   second half of context
-		 *   3   unified
-		 */
-		lineno++;
-		switch (state) {
-		case 0:
-			if (sscanf(cp, "@@ -%99s +%99s @@%99[^\n]", before, after, func) >= 2) {
-				int ok = 1;
-				if (sscanf(before, "%d,%d", &a, &b) == 2)
-					acnt = b;
-				else if (sscanf(before, "%d", &a) == 1)
-					acnt = 1;
-				else
-					ok = 0;
-
-				if (sscanf(after, "%d,%d", &c, &d) == 2)
-					bcnt = d;
-				else if (sscanf(after, "%d", &c) == 1)
-					bcnt = 1;
-				else
-					ok = 0;
-				if (ok)
-					state = 3;
-				else
-					state = 0;
-			} else if (sscanf(cp, "*** %d,%d ****", &a, &b) == 2) {
-				acnt = b-a+1;
-				state = 1;
-			} else if (sscanf(cp, "--- %d,%d ----", &c, &d) == 2) {
-				bcnt = d-c+1;
-				state = 2;
-			} else
-				sscanf(cp, "***************%99[^\n]", func);
-
-			skip_eol(&cp, end);
-			if (state == 1 || state == 3) {
-				char *f;
-				int slen;
-				/* Reserve enough space for 3 integers separated
-				 * by a single space, and prefixed and terminated
-				 * with a null character.
-				 */
-				char buf[(3*12)+1];
-				buf[0] = 0;
-				chunks++;
-				slen = sprintf(buf+1, "%5d %5d %5d", chunks, a, acnt)+1;
-				memcpy(r1.body+r1.len, buf, slen);
-				r1.len += slen;
-				f = func;
-				while (*f == ' ')
-					f++;
-				if (*f) {
-					r1.body[r1.len++] = ' ';
-					strcpy(r1.body + r1.len, f);
-					r1.len += strlen(f);
-				}
-				r1.body[r1.len++] = '\n';
-				r1.body[r1.len++] = '\0';
-			}
-			if (state == 2 || state == 3) {
-				int slen;
-				/* Reserve enough space for 3 integers separated
-				 * by a single space, prefixed with a null character
-				 * and terminated with a new line and null character.
-				 */
-				char buf[(3*12)+2];
-				buf[0] = 0;
-				slen = sprintf(buf+1, "%5d %5d %5d\n", chunks, c, bcnt)+2;
-				memcpy(r2.body+r2.len, buf, slen);
-				r2.len += slen;
-			}
-			if (state)
-				func[0] = 0;
-			break;
-		case 1:
-			if ((*cp == ' ' || *cp == '!' || *cp == '-' || *cp == '+')
-			    && cp[1] == ' ') {
-				cp += 2;
-				copyline(&r1, &cp, end);
-				acnt--;
-				if (acnt == 0)
-					state = 0;
-			} else {
-				fprintf(stderr, "%s: bad context patch at line %d\n",
-					wiggle_Cmd, lineno);
-				return 0;
-			}
-			break;
-		case 2:
-			if ((*cp == ' ' || *cp == '!' || *cp == '-' || *cp == '+')
-			    && cp[1] == ' ') {
-				cp += 2;
-				copyline(&r2, &cp, end);
-				bcnt--;
-				if (bcnt == 0)
-					state = 0;
-			} else {
-				fprintf(stderr, "%s: bad context patch/2 at line %d\n",
-					wiggle_Cmd, lineno);
-				return 0;
-			}
-			break;
-		case 3:
-			if (*cp == ' ') {
-				char *cp2;
-				cp++;
-				cp2 = cp;
-				copyline(&r1, &cp, end);
-				copyline(&r2, &cp2, end);
-				acnt--; bcnt--;
-			} else if (*cp == '-') {
-				cp++;
-				copyline(&r1, &cp, end);
-				acnt--;
-			} else if (*cp == '+') {
-				cp++;
-				copyline(&r2, &cp, end);
-				bcnt--;
-			} else if (*cp == '\n') {
-				/* Empty line - treat like " \n" - a blank line in both */
-				char *cp2 = cp;
-				copyline(&r1, &cp, end);
-				copyline(&r2, &cp2, end);
-				acnt --; bcnt--;
-			} else {
-				fprintf(stderr, "%s: bad unified patch at line %d\n",
-					wiggle_Cmd, lineno);
-				return 0;
-			}
-			if (acnt <= 0 && bcnt <= 0)
-				state = 0;
-			break;
-		}
+		char *next = cp;
+
+		skip_eol(&next, end);
+		if (patch_line(&ps, cp, end, out) < 0)
+			return 0;
+		cp = next;
 	}
 	if (r1.len > f.len || r2.len > f.len)
 		abort();
 	*f1 = r1;
 	*f2 = r2;
-	return chunks;
+	return ps.chunks;
+}
+
+struct merge_state {
+	/* state:
+	 *  0 not in conflict
+	 *  1 in file 1 of conflict
+	 *  2 in file 2 of conflict
+	 *  3 in file 3 of conflict
+	 *  4 in file 2 but expecting 1/3 next
+	 *  5 in file 1/3
+	 *  6 in file 1 or 2, not yet known which
+	 */
+	int state;
+	/* lines seen in state 6 */
+	struct stream pending;
+	int psize;
+};
+
+static int is_marker(char *cp, char *end, char *marker)
+{
+	return end - cp >= 8 &&
+		strncmp(cp, marker, 7) == 0 &&
+		(cp[7] == ' ' || cp[7] == '\n');
+}
+
+/* diff3 will do something a bit strange if
+ * the 1st and 3rd sections are the same.
+ * it reports
+ * <<<<<<<
+ * 2nd
+ * =======
+ * 1st and 3rd
+ * >>>>>>>
+ * Without a ||||||| at all.
+ * So we cannot know if we are in '1' or '2' until we see
+ * the next marker.  Until then, keep the lines in 'pending'.
+ */
+static void merge_decide(struct merge_state *ms, int state,
+			 struct xout out[3])
+{
+	ms->state = state;
+	put(&out[state == 1 ? 0 : 1], ms->pending.body, ms->pending.len);
+	ms->pending.len = 0;
+}
+
+/* For each state other than 6, the marker which ends it, the state
+ * that follows, and which of the three outputs other lines go to.
+ */
+static const struct merge_step {
+	char *marker;
+	int next;
+	int outs;
+} merge_steps[6] = {
+	[0] = { "<<<<<<<", 6, 1|2|4 },
+	[1] = { "|||||||", 2, 1 },
+	[2] = { "=======", 3, 2 },
+	[3] = { ">>>>>>>", 0, 4 },
+	[4] = { "=======", 5, 2 },
+	[5] = { ">>>>>>>", 0, 1|4 },
+};
+
+/* Send the lines from 'cp' to 'end', none of which are markers,
+ * to the outputs for the current state.
+ */
+static void merge_text(struct merge_state *ms, char *cp, char *end,
+		       struct xout out[3])
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if (merge_steps[ms->state].outs & (1 << i))
+			put(&out[i], cp, end - cp);
+}
+
+/* Find the first line at or after 'cp' which would end the current
+ * state, so everything before it can be handled by merge_text().
+ */
+static char *merge_skip(struct merge_state *ms, char *cp, char *end)
+{
+	char *marker = merge_steps[ms->state].marker;
+	char pat[8] = "\n";
+
+	if (is_marker(cp, end, marker))
+		return cp;
+	memcpy(pat+1, marker, 7);
+	while ((cp = memmem(cp, end - cp, pat, 8)) != NULL) {
+		cp++;
+		if (is_marker(cp, end, marker))
+			return cp;
+	}
+	return end;
+}
+
+static void merge_line(struct merge_state *ms, char *cp, char *end,
+		       struct xout out[3])
+{
+	char *cp2;
+
+	if (ms->state == 6) {
+		if (is_marker(cp, end, "|||||||") ||
+		    is_marker(cp, end, ">>>>>>>"))
+			merge_decide(ms, 1, out);
+		else if (is_marker(cp, end, "======="))
+			merge_decide(ms, 4, out);
+		else {
+			struct xout p = { &ms->pending, NULL };
+			cp2 = cp;
+			skip_eol(&cp2, end);
+			if (ms->pending.len + (cp2 - cp) > ms->psize) {
+				ms->psize = (ms->pending.len + (cp2 - cp)) * 2;
+				ms->pending.body = realloc(ms->pending.body,
+							   ms->psize);
+				if (!ms->pending.body)
+					wiggle_die("memory allocation");
+			}
+			copyline(&p, &cp, end);
+			return;
+		}
+	}
+	if (is_marker(cp, end, merge_steps[ms->state].marker))
+		ms->state = merge_steps[ms->state].next;
+	else {
+		cp2 = cp;
+		skip_eol(&cp2, end);
+		merge_text(ms, cp, cp2, out);
+	}
+}
+
+/* Returns 1 if the merge ended cleanly, outside any conflict */
+static int merge_finish(struct merge_state *ms, struct xout out[3])
+{
+	if (ms->state == 6)
+		merge_decide(ms, 1, out);
+	free(ms->pending.body);
+	return ms->state == 0;
 }
 
 /*
@@ -229,9 +462,12 @@ int wiggle_split_patch(struct stream f, struct stream *f1, struct stream *f2)
 int wiggle_split_merge(struct stream f, struct stream *f1, struct stream *f2,
 		       struct stream *f3)
 {
-	int state = 0;
 	char *cp, *end;
 	struct stream r1, r2, r3;
+	struct xout out[3] = { {&r1, NULL}, {&r2, NULL}, {&r3, NULL} };
+	struct merge_state ms = {};
+	int rv;
+
 	f1->body = NULL;
 	f2->body = NULL;
 
@@ -243,117 +479,93 @@ int wiggle_split_merge(struct stream f, struct stream *f1, struct stream *f2,
 	cp = f.body;
 	end = f.body+f.len;
 	while (cp < end) {
-		/* state:
-		 *  0 not in conflict
-		 *  1 in file 1 of conflict
-		 *  2 in file 2 of conflict
-		 *  3 in file 3 of conflict
-		 *  4 in file 2 but expecting 1/3 next
-		 *  5 in file 1/3
-		 */
-		int len = end-cp;
-		switch (state) {
-		case 0:
-			if (len >= 8 &&
-			    strncmp(cp, "<<<<<<<", 7) == 0 &&
-			    (cp[7] == ' ' || cp[7] == '\n')
-				) {
-				char *peek;
-				state = 1;
-				skip_eol(&cp, end);
-				/* diff3 will do something a bit strange in
-				 * the 1st and 3rd sections are the same.
-				 * it reports
-				 * <<<<<<<
-				 * 2nd
-				 * =======
-				 * 1st and 3rd
-				 * >>>>>>>
-				 * Without a ||||||| at all.
-				 * so to know if we are in '1' or '2', skip forward
-				 * having a peek.
-				 */
-				peek = cp;
-				while (peek < end) {
-					if (end-peek >= 8 &&
-					    (peek[7] == ' ' || peek[7] == '\n')) {
-						if (strncmp(peek, "|||||||", 7) == 0 ||
-						    strncmp(peek, ">>>>>>>", 7) == 0)
-							break;
-						else if (strncmp(peek, "=======", 7) == 0) {
-							state = 4;
-							break;
-						}
-					}
-					skip_eol(&peek, end);
-				}
-			} else {
-				char *cp2 = cp;
-				copyline(&r1, &cp2, end);
-				cp2 = cp;
-				copyline(&r2, &cp2, end);
-				copyline(&r3, &cp, end);
-			}
-			break;
-		case 1:
-			if (len >= 8 &&
-			    strncmp(cp, "|||||||", 7) == 0 &&
-			    (cp[7] == ' ' || cp[7] == '\n')
-				) {
-				state = 2;
-				skip_eol(&cp, end);
-			} else
-				copyline(&r1, &cp, end);
-			break;
-		case 2:
-			if (len >= 8 &&
-			    strncmp(cp, "=======", 7) == 0 &&
-			    (cp[7] == ' ' || cp[7] == '\n')
-				) {
-				state = 3;
-				skip_eol(&cp, end);
-			} else
-				copyline(&r2, &cp, end);
-			break;
-		case 3:
-			if (len >= 8 &&
-			    strncmp(cp, ">>>>>>>", 7) == 0 &&
-			    (cp[7] == ' ' || cp[7] == '\n')
-				) {
-				state = 0;
-				skip_eol(&cp, end);
-			} else
-				copyline(&r3, &cp, end);
-			break;
-		case 4:
-			if (len >= 8 &&
-			    strncmp(cp, "=======", 7) == 0 &&
-			    (cp[7] == ' ' || cp[7] == '\n')
-				) {
-				state = 5;
-				skip_eol(&cp, end);
-			} else
-				copyline(&r2, &cp, end);
-			break;
-		case 5:
-			if (len >= 8 &&
-			    strncmp(cp, ">>>>>>>", 7) == 0 &&
-			    (cp[7] == ' ' || cp[7] == '\n')
-				) {
-				state = 0;
-				skip_eol(&cp, end);
-			} else {
-				char *t = cp;
-				copyline(&r1, &t, end);
-				copyline(&r3, &cp, end);
-			}
-			break;
+		char *next;
+
+		if (ms.state != 6) {
+			/* copy all the text up to the next marker at once */
+			next = merge_skip(&ms, cp, end);
+			merge_text(&ms, cp, next, out);
+			cp = next;
+			if (cp == end)
+				break;
 		}
+		next = cp;
+		skip_eol(&next, end);
+		merge_line(&ms, cp, next, out);
+		cp = next;
 	}
-	if (cp > end)
-		abort();
+	rv = merge_finish(&ms, out);
 	*f1 = r1;
 	*f2 = r2;
 	*f3 = r3;
-	return state == 0;
+	return rv;
+}
+
+/* Read a line for wiggle_extract(), supplying a missing final
+ * newline as wiggle_load_file() does.
+ * If 'limit' is not negative, no more than that many bytes are read.
+ */
+static ssize_t read_line(FILE *f, char **line, size_t *size, long *limit)
+{
+	ssize_t len;
+
+	if (*limit == 0)
+		return -1;
+	len = getline(line, size, f);
+	if (len <= 0)
+		return -1;
+	if (*limit > 0) {
+		if (len > *limit)
+			len = *limit;
+		*limit -= len;
+	}
+	if ((*line)[len-1] != '\n') {
+		if ((size_t)len + 2 > *size) {
+			*size = len + 2;
+			*line = realloc(*line, *size);
+			if (!*line)
+				wiggle_die("memory allocation");
+		}
+		(*line)[len++] = '\n';
+	}
+	(*line)[len] = 0;
+	return len;
+}
+
+/* Write one part ('which' is 1, 2 or 3) of a patch or merge read
+ * from 'in' to 'out' as it is read, holding at most one line (or
+ * one conflict section of an ambiguous diff3 merge) in memory.
+ * For a patch, returns the number of hunks, or -1 if it is malformed,
+ * in which case what has been written is incomplete.
+ * For a merge, returns 1 if it ended cleanly, else 0.
+ */
+int wiggle_extract(FILE *in, long limit, FILE *out, int ispatch, int which)
+{
+	struct xout xo[3] = {};
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int rv;
+
+	xo[which-1].f = out;
+	if (ispatch) {
+		struct patch_state ps = {};
+
+		rv = 0;
+		while ((len = read_line(in, &line, &size, &limit)) > 0)
+			if (patch_line(&ps, line, line + len, xo) < 0) {
+				rv = -1;
+				break;
+			}
+		if (rv == 0)
+			rv = ps.chunks;
+	} else {
+		struct merge_state ms = {};
+
+		while ((len = read_line(in, &line, &size, &limit)) > 0)
+			merge_line(&ms, line, line + len, xo);
+		rv = merge_finish(&ms, xo);
+	}
+	free(line);
+	return rv;
 }
@@ -0,0 +1,160 @@
+/*
+ * wiggle - apply rejected patches
+ *
+ * Copyright (C) 2003 Neil Brown <neilb@cse.unsw.edu.au>
+ * Copyright (C) 2010-2013 Neil Brown <neilb@suse.de>
+ * Copyright (C) 2014-2020 Neil Brown <neil@brown.name>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.
+ *
+ *    Author: Neil Brown
+ *    Email: <neil@brown.name>
+ */
+
+/*
+ * Read files from a git repository as they are in some revision,
+ * without checking it out.
+ *
+ * The first time an object is wanted, "git cat-file --batch" is
+ * started in the current directory (so GIT_DIR is honoured), and
+ * every object after that is asked of the same process.  Checking
+ * whether a patch applies to a revision then costs one process, not
+ * a worktree.
+ */
+
+#include	"wiggle.h"
+#include	<errno.h>
+#include	<unistd.h>
+#include	<stdlib.h>
+#include	<signal.h>
+#include	<limits.h>
+
+static FILE *to_git, *from_git;
+
+static int git_start(void)
+{
+	int in[2], out[2];
+	pid_t pid;
+
+	if (pipe(in) != 0)
+		return 0;
+	if (pipe(out) != 0) {
+		close(in[0]);
+		close(in[1]);
+		return 0;
+	}
+	pid = fork();
+	if (pid < 0) {
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		return 0;
+	}
+	if (pid == 0) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execlp("git", "git", "cat-file", "--batch", NULL);
+		fprintf(stderr, "%s: cannot run git - %s\n",
+			wiggle_Cmd, strerror(errno));
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	/* If git goes away, see that as an error rather than dying */
+	signal(SIGPIPE, SIG_IGN);
+	to_git = fdopen(in[1], "w");
+	from_git = fdopen(out[0], "r");
+	if (!to_git || !from_git)
+		wiggle_die("fdopen");
+	return 1;
+}
+
+/* Ask git for 'object' and return its content if it is of 'type'.
+ * If it is some other type the body is NULL and errno is EISDIR
+ * for a tree or EINVAL otherwise.  If it doesn't exist, errno is
+ * ENOENT.
+ */
+static struct stream git_get(char *object, char *type)
+{
+	struct stream s = {NULL, 0};
+	char *line = NULL;
+	size_t size = 0;
+	char otype[20];
+	long len;
+
+	if (!to_git && !git_start())
+		return s;
+	if (strchr(object, '\n')) {
+		errno = ENOENT;
+		return s;
+	}
+	if (fprintf(to_git, "%s\n", object) < 0 || fflush(to_git) != 0 ||
+	    getline(&line, &size, from_git) <= 0) {
+		fprintf(stderr, "%s: lost contact with git cat-file\n",
+			wiggle_Cmd);
+		free(line);
+		errno = EPIPE;
+		return s;
+	}
+	if (sscanf(line, "%*s %19s %ld", otype, &len) != 2) {
+		/* "object missing" or "object ambiguous" */
+		free(line);
+		errno = ENOENT;
+		return s;
+	}
+	free(line);
+	if (len < 0 || len > INT_MAX - 2)
+		wiggle_die("git object too large");
+	s.body = wiggle_xmalloc(len + 2);
+	if (fread(s.body, 1, len, from_git) != (size_t)len ||
+	    getc(from_git) != '\n')
+		wiggle_die("git cat-file read");
+	s.len = len;
+	if (strcmp(otype, type) != 0) {
+		free(s.body);
+		s.body = NULL;
+		s.len = 0;
+		errno = strcmp(otype, "tree") == 0 ? EISDIR : EINVAL;
+	}
+	return s;
+}
+
+/* Load 'object', a name such as "v6.1:fs/namei.c", which must be a
+ * blob.  The caller adds the final newline and nul as for a file.
+ */
+struct stream wiggle_git_load(char *object)
+{
+	return git_get(object, "blob");
+}
+
+/* Does 'rev' name a commit or tree in the repository? */
+int wiggle_git_valid(char *rev)
+{
+	struct stream s;
+	char *object;
+
+	asprintf(&object, "%s^{tree}", rev);
+	s = git_get(object, "tree");
+	free(object);
+	if (!s.body)
+		return 0;
+	free(s.body);
+	return 1;
+}
@@ -0,0 +1,138 @@
+/*
+ * wiggle - apply rejected patches
+ *
+ * Copyright (C) 2020 Neil Brown <neil@brown.name>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.
+ *
+ *    Author: Neil Brown
+ *    Email: <neil@brown.name>
+ */
+
+/*
+ * Compare wiggle_hash() against the ccan hash_any() that split.c
+ * used to use.
+ *   hashbench [-l] file [rounds]
+ * splits 'file' into words (or lines with -l), hashes every token
+ * 'rounds' times with each function, and reports the time per token
+ * and the number of distinct tokens which collide with another.
+ */
+
+#include	"wiggle.h"
+#include	<time.h>
+#include	"ccan/hash/hash.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_text(const void *v1, const void *v2)
+{
+	const struct elmnt *e1 = v1, *e2 = v2;
+
+	if (e1->len != e2->len)
+		return e1->len - e2->len;
+	return memcmp(e1->start, e2->start, e1->len);
+}
+
+static int cmp_hash(const void *v1, const void *v2)
+{
+	const struct elmnt *e1 = v1, *e2 = v2;
+
+	if (e1->hash != e2->hash)
+		return e1->hash < e2->hash ? -1 : 1;
+	return 0;
+}
+
+/* Count distinct tokens which share their hash with another */
+static int collisions(struct elmnt *l, int cnt, int wide)
+{
+	struct elmnt *d = wiggle_xmalloc(sizeof(*d) * (cnt + 1));
+	int i, n = 0, c = 0;
+
+	qsort(l, cnt, sizeof(*l), cmp_text);
+	for (i = 0; i < cnt; i++)
+		if (n == 0 || cmp_text(&d[n-1], &l[i]) != 0) {
+			d[n] = l[i];
+			if (wide)
+				d[n].hash = wiggle_hash(l[i].start, l[i].len);
+			else
+				d[n].hash = hash_any(l[i].start, l[i].len, 0);
+			n++;
+		}
+	qsort(d, n, sizeof(*d), cmp_hash);
+	for (i = 0; i < n; i++)
+		if ((i > 0 && d[i].hash == d[i-1].hash) ||
+		    (i+1 < n && d[i].hash == d[i+1].hash))
+			c++;
+	free(d);
+	return c;
+}
+
+int main(int argc, char *argv[])
+{
+	struct stream s;
+	struct file f;
+	int type = ByWord;
+	int rounds = 20;
+	int i, r;
+	uint64_t sum = 0;
+	double t1, t2, t3;
+
+	if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+		type = ByLine;
+		argc--;
+		argv++;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "Usage: hashbench [-l] file [rounds]\n");
+		exit(2);
+	}
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	s = wiggle_load_file(argv[1]);
+	if (!s.body) {
+		fprintf(stderr, "hashbench: cannot load %s\n", argv[1]);
+		exit(2);
+	}
+	f = wiggle_split_stream(s, type);
+
+	t1 = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < f.elcnt; i++)
+			sum += hash_any(f.list[i].start, f.list[i].len, 0);
+	t2 = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < f.elcnt; i++)
+			sum += wiggle_hash(f.list[i].start, f.list[i].len);
+	t3 = now();
+
+	printf("%d %s, %d rounds\n", f.elcnt,
+	       type == ByLine ? "lines" : "words", rounds);
+	printf("hash_any:    %6.2f ns/token, %d colliding\n",
+	       (t2 - t1) * 1e9 / rounds / f.elcnt,
+	       collisions(f.list, f.elcnt, 0));
+	printf("wiggle_hash: %6.2f ns/token, %d colliding\n",
+	       (t3 - t2) * 1e9 / rounds / f.elcnt,
+	       collisions(f.list, f.elcnt, 1));
+	/* keep the compiler from discarding the loops */
+	if (sum == 1)
+		printf("\n");
+	return 0;
+}
@@ -40,6 +40,8 @@
 #include	<unistd.h>
 #include	<fcntl.h>
 #include	<stdlib.h>
+#include	<errno.h>
+#include	<limits.h>
 
 static void join_streams(struct stream list[], int cnt)
 {
@@ -53,7 +55,7 @@ static void join_streams(struct stream list[], int cnt)
 	for (i = 0; i < cnt ; i++)
 		len += list[i].len;
 
-	c = realloc(list[0].body, len+1);
+	c = realloc(list[0].body, len+2);
 	if (c == NULL)
 		wiggle_die("memory allocation");
 
@@ -69,6 +71,16 @@ static void join_streams(struct stream list[], int cnt)
 	c[0] = 0;
 }
 
+/* Supply a missing final newline, and nul-terminate for sscanf.
+ * There must be room for both.
+ */
+static void add_eol(struct stream *s)
+{
+	if (s->len && s->body[s->len-1] != '\n')
+		s->body[s->len++] = '\n';
+	s->body[s->len] = 0;
+}
+
 static struct stream wiggle_load_regular(int fd)
 {
 	struct stat stb;
@@ -79,9 +91,6 @@ static struct stream wiggle_load_regular(int fd)
 	s.body = wiggle_xmalloc(s.len+2);
 	if (read(fd, s.body, s.len) != s.len)
 		wiggle_die("file read");
-	if (s.len && s.body[s.len-1] != '\n')
-		s.body[s.len++] = '\n';
-	s.body[s.len] = 0;
 	return s;
 }
 
@@ -97,11 +106,8 @@ static struct stream wiggle_load_other(int fd)
 		if (list[i].len < 0)
 			wiggle_die("file read");
 		if (list[i].len == 0) {
-			if (i && list[i-1].body[list[i-i].len-1] != '\n') {
-				list[i].body[0] = '\n';
-				list[i].len = 1;
-				i += 1;
-			}
+			if (i)
+				free(list[i].body);
 			break;
 		}
 		i++;
@@ -128,6 +134,47 @@ struct stream wiggle_load_segment(FILE *f,
 	return s;
 }
 
+/* Load bytes 'start' to 'end' of 'name'.  If it is compressed, these
+ * are offsets into the decompressed text.  multi_merge() loads every
+ * part of a patch this way, so the last decompressed file is kept.
+ */
+static struct stream load_part(char *name, int start, int end)
+{
+	static char *zname;
+	static struct stream z;
+	struct stream s = {NULL, 0};
+	char magic[6];
+	int n;
+	FILE *f;
+
+	if (!zname || strcmp(name, zname) != 0) {
+		f = fopen(name, "r");
+		if (!f)
+			return s;
+		n = fread(magic, 1, sizeof(magic), f);
+		if (wiggle_compressed(magic, n) == COMPRESS_NONE) {
+			s = wiggle_load_segment(f, start, end);
+			fclose(f);
+			return s;
+		}
+		fclose(f);
+		free(zname);
+		free(z.body);
+		zname = NULL;
+		z = wiggle_load_file(name);
+		if (!z.body)
+			return s;
+		zname = strdup(name);
+	}
+	if (start < 0 || end > z.len || start > end)
+		return s;
+	s.len = end - start;
+	s.body = wiggle_xmalloc(s.len + 1);
+	memcpy(s.body, z.body + start, s.len);
+	s.body[s.len] = 0;
+	return s;
+}
+
 struct stream wiggle_load_file(char *name)
 {
 	struct stream s;
@@ -140,14 +187,17 @@ struct stream wiggle_load_file(char *name)
 	s.len = 0;
 	if (sscanf(name, "_wiggle_:%d:%d:%n", &start, &end,
 		   &prefix_len) >= 2 && prefix_len > 0) {
-		FILE *f = fopen(name + prefix_len, "r");
-		if (f) {
-			s = wiggle_load_segment(f, start, end);
-			fclose(f);
-		} else {
+		s = load_part(name + prefix_len, start, end);
+	} else if (strncmp(name, "_wiggle_git_:", 13) == 0) {
+		/* "revision:path" in the git repository */
+		s = wiggle_git_load(name + 13);
+		if (s.body && !wiggle_decompress(&s, name + 13)) {
+			free(s.body);
 			s.body = NULL;
 			s.len = 0;
 		}
+		if (s.body)
+			add_eol(&s);
 	} else {
 		if (strcmp(name, "-") == 0)
 			fd = 0;
@@ -165,7 +215,127 @@ struct stream wiggle_load_file(char *name)
 				s = wiggle_load_other(fd);
 		}
 		close(fd);
+		if (s.body && !wiggle_decompress(&s, name)) {
+			free(s.body);
+			s.body = NULL;
+			s.len = 0;
+		}
+		if (s.body)
+			add_eol(&s);
 	}
 	return s;
 }
 
+/* Is the file 'name' compressed?  A merge is written uncompressed, so
+ * such a file cannot be replaced by one.
+ */
+int wiggle_file_compressed(char *name)
+{
+	char magic[6];
+	int fd, n;
+
+	if (strcmp(name, "-") == 0 || strncmp(name, "_wiggle_", 8) == 0)
+		return 0;
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, magic, sizeof(magic));
+	close(fd);
+	return n > 0 && wiggle_compressed(magic, n) != COMPRESS_NONE;
+}
+
+/* Open 'name' to be read a line at a time, accepting the same names
+ * as wiggle_load_file().  *limitp is set to the number of bytes that
+ * may be read, or -1 if there is no limit.
+ */
+FILE *wiggle_open_file(char *name, long *limitp)
+{
+	FILE *f;
+	int start, end;
+	int prefix_len = 0;
+
+	*limitp = -1;
+	if (sscanf(name, "_wiggle_:%d:%d:%n", &start, &end,
+		   &prefix_len) >= 2 && prefix_len > 0) {
+		f = fopen(name + prefix_len, "r");
+		if (f) {
+			fseek(f, start, 0);
+			*limitp = end - start;
+		}
+		return f;
+	}
+	return wiggle_fopen(name);
+}
+
+/* Open 'name' (or stdin for "-") for reading.  If the content is
+ * compressed, it is decompressed into memory and a stream reading
+ * from there is returned, so it can still be read with seeks.
+ */
+FILE *wiggle_fopen(char *name)
+{
+	FILE *f, *mf;
+	struct stream s;
+	char magic[6];
+	size_t n, size;
+
+	if (strcmp(name, "-") == 0)
+		f = stdin;
+	else
+		f = fopen(name, "r");
+	if (!f)
+		return NULL;
+	wiggle_check_dir(name, fileno(f));
+	if (f == stdin) {
+		/* Cannot rewind stdin, so only read it all in if
+		 * the first byte suggests it might be compressed.
+		 */
+		int c = getc(f);
+		if (c == EOF)
+			return f;
+		ungetc(c, f);
+		if (!wiggle_maybe_compressed(c))
+			return f;
+	} else {
+		n = fread(magic, 1, sizeof(magic), f);
+		rewind(f);
+		if (wiggle_compressed(magic, n) == COMPRESS_NONE)
+			return f;
+	}
+
+	size = 65536;
+	s.body = wiggle_xmalloc(size);
+	s.len = 0;
+	while ((n = fread(s.body + s.len, 1, size - s.len, f)) > 0) {
+		s.len += n;
+		if ((size_t)s.len == size) {
+			if (size >= INT_MAX / 2) {
+				fprintf(stderr, "%s: %s is too large\n",
+					wiggle_Cmd, name);
+				if (f != stdin)
+					fclose(f);
+				free(s.body);
+				errno = EFBIG;
+				return NULL;
+			}
+			size *= 2;
+			s.body = realloc(s.body, size);
+			if (!s.body)
+				wiggle_die("memory allocation");
+		}
+	}
+	if (f != stdin)
+		fclose(f);
+	if (!wiggle_decompress(&s, name)) {
+		free(s.body);
+		return NULL;
+	}
+	/* The buffer of a "w+" memory stream is freed by fclose() */
+	mf = fmemopen(NULL, s.len + 1, "w+");
+	if (mf) {
+		if (fwrite(s.body, 1, s.len, mf) != (size_t)s.len)
+			wiggle_die("memory stream write");
+		rewind(mf);
+	}
+	free(s.body);
+	return mf;
+}
@@ -90,6 +90,64 @@ static int is_cutpoint(struct merge m,
 		(m.c == 0 || ends_line(cf.list[m.c-1])));
 }
 
+/* Conflict isolation needs to count newlines in ranges of a stream and
+ * to find the first or last newline in a range.  Scanning elements for
+ * this each time makes dense conflicts quadratic, so we record the
+ * line-ends once: nl[i] is the number of line-ends before element i
+ * (a rank) and eol[n] is the index of the n'th line-end (a select).
+ * 'eol' is only filled in when asked for.
+ */
+struct lines {
+	int *nl;
+	int *eol;
+	int elcnt;
+};
+
+static struct lines find_lines(struct file f, int want_eol)
+{
+	struct lines l;
+	int i, n = 0;
+
+	l.elcnt = f.elcnt;
+	l.nl = wiggle_xmalloc(sizeof(int) * (f.elcnt + 1));
+	l.eol = want_eol ? wiggle_xmalloc(sizeof(int) * (f.elcnt + 1)) : NULL;
+	for (i = 0; i < f.elcnt; i++) {
+		l.nl[i] = n;
+		if (ends_line(f.list[i])) {
+			if (l.eol)
+				l.eol[n] = i;
+			n++;
+		}
+	}
+	l.nl[i] = n;
+	return l;
+}
+
+/* number of line-ends in elements start .. start+len-1 */
+static inline int lines_in(struct lines *l, int start, int len)
+{
+	int end = start + len;
+
+	if (end > l->elcnt)
+		end = l->elcnt;
+	if (start >= end)
+		return 0;
+	return l->nl[end] - l->nl[start];
+}
+
+/* After finding 'n' more newlines, how many have been counted?
+ * The search stops as soon as 3 are found, but always counts at
+ * least the first new one.
+ */
+static inline int add_newlines(int newlines, int n)
+{
+	if (n == 0)
+		return newlines;
+	if (newlines >= 3)
+		return newlines + 1;
+	return newlines + min(n, 3 - newlines);
+}
+
 int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 			     struct csl *csl1, struct csl *csl2, int words,
 			     struct merge *m, int show_wiggles,
@@ -135,6 +193,12 @@ int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 	 * If a wiggle is adjacent to a conflict then:
 	 * - if show_wiggles is set, we just merge them
 	 * - if it is not set, we still want to count the wiggle.
+	 *
+	 * All newline searches go through the 'lines' tables so each
+	 * merge costs constant time no matter how long it is.  The
+	 * backward search never passes the previous conflict and the
+	 * forward search moves 'i' past everything it visits, so the
+	 * whole pass is linear in the number of merges.
 	 */
 	int i, j, k;
 	int cnt = 0, wiggles = 0;
@@ -142,6 +206,8 @@ int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 	int changed = 0;
 	int unmatched = 0;
 	int extraneous = 0;
+	struct lines alines = find_lines(af, 1);
+	struct lines blines = find_lines(bf, 0);
 
 	for (i = 0; m[i].type != End; i++)
 		m[i].in_conflict = 0;
@@ -197,11 +263,8 @@ int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 				/* Following must set m[j].hi, or set
 				 * in_conflict > 1
 				 */
-				if (m[j].type == Extraneous) {
-					for (k = m[j].bl; k > 0; k--)
-						if (ends_line(bf.list[m[j].b+k-1]))
-							newlines++;
-				}
+				if (m[j].type == Extraneous)
+					newlines += lines_in(&blines, m[j].b, m[j].bl);
 
 				if (m[j].type != Unchanged &&
 				    m[j].type != Changed) {
@@ -225,19 +288,18 @@ int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 				 * might be after the last newline, if there
 				 * is one, or might be at the start
 				 */
-				for (k = m[j].al; k > 0; k--) {
-					if (m[j].a + k >= af.elcnt)
-						/* FIXME impossible!*/
-						break;
-					if (ends_line(af.list[m[j].a+k-1])) {
-						if (firstk > m[j].al)
-							firstk = k;
-						newlines++;
-						if (newlines >= 3) {
-							k = firstk;
-							break;
-						}
-					}
+				k = 0;
+				if (m[j].a + m[j].al >= af.elcnt)
+					/* FIXME impossible!*/
+					k = m[j].al;
+				else if (lines_in(&alines, m[j].a, m[j].al)) {
+					firstk = alines.eol[alines.nl[m[j].a + m[j].al] - 1]
+						- m[j].a + 1;
+					newlines = add_newlines(
+						newlines,
+						lines_in(&alines, m[j].a, m[j].al));
+					if (newlines >= 3)
+						k = firstk;
 				}
 				if (k > 0)
 					m[j].hi = k;
@@ -265,11 +327,8 @@ int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 			/* now the forward search */
 			newlines = 0;
 			for (j = i+1; m[j].type != End; j++) {
-				if (m[j].type == Extraneous) {
-					for (k = 0; k < m[j].bl; k++)
-						if (ends_line(bf.list[m[j].b+k]))
-							newlines++;
-				}
+				if (m[j].type == Extraneous)
+					newlines += lines_in(&blines, m[j].b, m[j].bl);
 				if (m[j].type != Unchanged &&
 				    m[j].type != Changed) {
 					if (m[j].type == Conflict)
@@ -297,35 +356,25 @@ int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 					 * to track which newline we actually use
 					 */
 					int firstk = -1;
-					for (k = 0 ; k < m[j].al ; k++)
-						if (ends_line(af.list[m[j].a+k])) {
-							if (firstk < 0)
-								firstk = k;
-							newlines++;
-							if (newlines >= 3) {
-								k = firstk;
-								break;
-							}
-						}
+					int nl = lines_in(&alines, m[j].a, m[j].al);
+
+					k = m[j].al;
+					if (nl) {
+						firstk = alines.eol[alines.nl[m[j].a]] - m[j].a;
+						newlines = add_newlines(newlines, nl);
+						if (newlines >= 3)
+							k = firstk;
+					}
 					if (newlines < 3 &&
 					    m[j+1].type  == End)
 						/* Hit end of file, pretend we found 3 newlines. */
 						k = firstk;
 
 					if (firstk >= 0 &&
-					    m[j+1].type == Unmatched) {
+					    m[j+1].type == Unmatched &&
+					    lines_in(&alines, m[j+1].a, m[j+1].al) > 3)
 						/* If this Unmatched exceeds 3 lines, just stop here */
-						int p;
-						int nl = 0;
-						for (p = 0; p < m[j+1].al ; p++)
-							if (ends_line(af.list[m[j+1].a+p])) {
-								nl++;
-								if (nl > 3)
-									break;
-							}
-						if (nl > 3)
-							k = firstk;
-					}
+						k = firstk;
 					if (k < m[j].al)
 						m[j].lo = k+1;
 					else
@@ -381,22 +430,25 @@ int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 			if (m[i].type == End)
 				break;
 		}
-		for (k = 1; k < m[i].al; k++) {
-			if (m[i].a + k >= af.elcnt)
-				/* FIXME this should be impossible, but
-				 * it happened.
-				 */
-				break;
-			if (words || ends_line(af.list[m[i].a+k])) {
-				if (unmatched)
-					unmatched--;
-				if (changed)
-					changed--;
-				if (extraneous)
-					extraneous--;
-			}
+		/* Count down the newlines after the first element.
+		 * lines_in() clips at af.elcnt, which "should be
+		 * impossible, but it happened".
+		 */
+		if (m[i].al > 1) {
+			if (words) {
+				k = min(m[i].a + m[i].al, af.elcnt) - (m[i].a + 1);
+				if (k < 0)
+					k = 0;
+			} else
+				k = lines_in(&alines, m[i].a + 1, m[i].al - 1);
+			unmatched = unmatched > k ? unmatched - k : 0;
+			changed = changed > k ? changed - k : 0;
+			extraneous = extraneous > k ? extraneous - k : 0;
 		}
 	}
+	free(alines.nl);
+	free(alines.eol);
+	free(blines.nl);
 	if (!show_wiggles)
 		*wigglesp = wiggles;
 	/* Now count the conflicts and wiggles */
@@ -427,11 +479,13 @@ int wiggle_isolate_conflicts(struct file af, struct file bf, struct file cf,
 	return cnt;
 }
 
-struct ci wiggle_make_merger(struct file af, struct file bf, struct file cf,
-			     struct csl *csl1, struct csl *csl2, int words,
-			     int ignore_already, int show_wiggles)
+static struct ci build_merger(struct file af, struct file bf, struct file cf,
+			      struct csl *csl1, struct csl *csl2,
+			      int ignore_already, int stop_at_conflict)
 {
 	/* find the wiggles and conflicts between csl1 and csl2
+	 * If stop_at_conflict, give up as soon as we find a Conflict,
+	 * returning no merger and a conflict count of 1.
 	 */
 	struct ci rv;
 	int i, l;
@@ -441,14 +495,15 @@ struct ci wiggle_make_merger(struct file af, struct file bf, struct file cf,
 
 	rv.conflicts = rv.wiggles = rv.ignored = 0;
 
+	/* Usually there are about as many merges as there are common
+	 * sequences, so start with that and grow as needed.
+	 */
 	for (i = 0; csl1[i].len; i++)
 		;
 	l = i;
 	for (i = 0; csl2[i].len; i++)
 		;
-	l += i;
-	/* maybe a bit of slack at each end */
-	l = l * 4 + 10;
+	l += i + 2;
 
 	rv.merger = wiggle_xmalloc(sizeof(struct merge)*l);
 
@@ -456,6 +511,13 @@ struct ci wiggle_make_merger(struct file af, struct file bf, struct file cf,
 	i = 0;
 	while (1) {
 		int match1, match2;
+
+		if (i + 1 >= l) {
+			l += l;
+			rv.merger = realloc(rv.merger, sizeof(struct merge)*l);
+			if (!rv.merger)
+				wiggle_die("memory allocation");
+		}
 		match1 = (a >= csl1[c1].a && b >= csl1[c1].b); /* c1 doesn't match */
 		match2 = (b >= csl2[c2].a && c >= csl2[c2].b);
 
@@ -473,8 +535,6 @@ struct ci wiggle_make_merger(struct file af, struct file bf, struct file cf,
 		rv.merger[i].a = a;
 		rv.merger[i].b = b;
 		rv.merger[i].c = c;
-		rv.merger[i].c1 = c1;
-		rv.merger[i].c2 = c2;
 		rv.merger[i].in_conflict = 0;
 
 		if (!match1 && match2) {
@@ -573,6 +633,13 @@ struct ci wiggle_make_merger(struct file af, struct file bf, struct file cf,
 				rv.merger[i].al = 0;
 		}
 		rv.merger[i].oldtype = rv.merger[i].type;
+		if (stop_at_conflict && rv.merger[i].type == Conflict) {
+			/* isolate_conflicts always counts a Conflict */
+			free(rv.merger);
+			rv.merger = NULL;
+			rv.conflicts = 1;
+			return rv;
+		}
 		a += rv.merger[i].al;
 		b += rv.merger[i].bl;
 		c += rv.merger[i].cl;
@@ -594,10 +661,13 @@ struct ci wiggle_make_merger(struct file af, struct file bf, struct file cf,
 	rv.merger[i].a = a;
 	rv.merger[i].b = b;
 	rv.merger[i].c = c;
-	rv.merger[i].c1 = c1;
-	rv.merger[i].c2 = c2;
 	rv.merger[i].in_conflict = 0;
-	assert(i < l);
+	/* Don't hold on to any slack - the merger can be long-lived */
+	if (i + 1 < l) {
+		struct merge *m = realloc(rv.merger, sizeof(struct merge)*(i+1));
+		if (m)
+			rv.merger = m;
+	}
 
 	/* Now revert any AlreadyApplied that aren't bounded by
 	 * Unchanged or Changed.
@@ -613,8 +683,55 @@ struct ci wiggle_make_merger(struct file af, struct file bf, struct file cf,
 		    rv.merger[i+1].type != End)
 			rv.merger[i].type = Conflict;
 	}
+	return rv;
+}
+
+/* An upper bound on the memory wiggle_make_merger() needs for files
+ * of 'a', 'b' and 'c' elements, given the csl lists already exist.
+ * There is at most one merge per element, and the line tables used
+ * by wiggle_isolate_conflicts() have two ints per element.
+ */
+long wiggle_merge_cost(int a, int b, int c)
+{
+	long n = (long)a + b + c + 2;
+
+	return n * sizeof(struct merge) + n * 2 * sizeof(int);
+}
+
+struct ci wiggle_make_merger(struct file af, struct file bf, struct file cf,
+			     struct csl *csl1, struct csl *csl2, int words,
+			     int ignore_already, int show_wiggles)
+{
+	struct ci rv;
+
+	rv = build_merger(af, bf, cf, csl1, csl2, ignore_already, 0);
+	rv.conflicts = wiggle_isolate_conflicts(af, bf, cf, csl1, csl2, words,
+						rv.merger, show_wiggles, &rv.wiggles);
+	return rv;
+}
+
+/* Just count the conflicts and wiggles without keeping the merger.
+ * If 'first_only', we only want to know if there are any conflicts,
+ * so stop at the first one found.  In that case 'conflicts' is at
+ * most 1 and 'wiggles' may not be counted.
+ * The returned 'merger' is always NULL.
+ */
+struct ci wiggle_check_merger(struct file af, struct file bf, struct file cf,
+			      struct csl *csl1, struct csl *csl2, int words,
+			      int ignore_already, int show_wiggles,
+			      int first_only)
+{
+	struct ci rv;
+
+	rv = build_merger(af, bf, cf, csl1, csl2, ignore_already, first_only);
+	if (!rv.merger)
+		return rv;
 	rv.conflicts = wiggle_isolate_conflicts(af, bf, cf, csl1, csl2, words,
 						rv.merger, show_wiggles, &rv.wiggles);
+	free(rv.merger);
+	rv.merger = NULL;
+	if (first_only && rv.conflicts)
+		rv.conflicts = 1;
 	return rv;
 }
 
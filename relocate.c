@@ -0,0 +1,621 @@
+/*
+ * wiggle - apply rejected patches
+ *
+ * Copyright (C) 2003 Neil Brown <neilb@cse.unsw.edu.au>
+ * Copyright (C) 2010-2013 Neil Brown <neilb@suse.de>
+ * Copyright (C) 2014-2020 Neil Brown <neil@brown.name>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.
+ *
+ *    Author: Neil Brown
+ *    Email: <neil@brown.name>
+ */
+
+/*
+ * Look through a directory tree for hunks that have moved to another file.
+ *
+ * wiggle_pdiff() only looks for a hunk in the file the patch names.  If
+ * the code has since moved to another file, the hunk isn't found at
+ * all, or only a few of its words are matched somewhere unrelated.
+ * With --search=dir, each such hunk is looked for in the other files
+ * under 'dir' and the best place found is reported.
+ *
+ * Running find_best() over every file would take far too long, so the
+ * tree is indexed first.  Each file is reduced to the same interesting
+ * words that bestmatch.c looks at, and every run of SHINGLE of them is
+ * hashed.  Only hashes with the low SAMPLE bits clear are kept, which
+ * is enough to notice a run of text of any size that two files share
+ * without the index being as big as the tree.  The index is kept in
+ * INDEX_NAME at the top of the tree, and only files whose size or
+ * modification time has changed are hashed again next time.
+ *
+ * A lost hunk is hashed the same way and the files sharing most of its
+ * hashes become candidates.  In each one, find_best() is only run over
+ * the part of the file where those hashes are, and the candidates are
+ * searched at the same time, each in its own process.
+ */
+
+#include	"wiggle.h"
+#include	<errno.h>
+#include	<unistd.h>
+#include	<stdlib.h>
+#include	<ctype.h>
+#include	<dirent.h>
+#include	<limits.h>
+#include	<sys/stat.h>
+#include	<sys/wait.h>
+
+char *wiggle_search_dir;
+
+#define SHINGLE 4	/* words hashed together */
+#define SAMPLE 3	/* low bits that must be clear for a hash to be kept */
+#define CANDIDATES 4	/* files searched for each hunk */
+#define MAX_INDEXED (8 << 20)	/* larger files are not looked in */
+#define INDEX_NAME ".wiggle-index"
+/* An index made with a different hash or sampling can't be used */
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define INDEX_MAGIC "wiggle-index 2 hash " XSTR(WIGGLE_HASH_VERSION) \
+	" shingle " XSTR(SHINGLE) " sample " XSTR(SAMPLE) "\n"
+
+struct entry {
+	char *path;	/* relative to wiggle_search_dir */
+	long mtime, size;
+	int cnt;
+	uint32_t *hash;	/* sorted, without duplicates */
+	int seen;
+};
+
+static inline int min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+static inline int max(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+/* Words that say where a hunk is, as hashed by shingles() */
+static inline int word(struct elmnt e)
+{
+	return isalnum(e.start[0]) || e.start[0] == '_';
+}
+
+static struct entry *tree;
+static int tree_cnt, tree_loaded;
+
+/* Hash each run of SHINGLE interesting words in start..end, and add
+ * those to be kept to *hp.  If 'offp' is given, the offset of the
+ * first word of each run is stored there.  Returns the new count.
+ */
+static int shingles(char *start, char *end, uint32_t **hp, int **offp,
+		    int cnt)
+{
+	uint64_t ring[SHINGLE];
+	int ringoff[SHINGLE];
+	int words = 0;
+	int size = cnt;
+	char *cp = start;
+
+	while (cp < end) {
+		char *w;
+		uint64_t h;
+		int j;
+
+		if (!isalnum(*cp) && *cp != '_') {
+			cp++;
+			continue;
+		}
+		w = cp;
+		while (cp < end && (isalnum(*cp) || *cp == '_'))
+			cp++;
+		ring[words % SHINGLE] = wiggle_hash(w, cp - w);
+		ringoff[words % SHINGLE] = w - start;
+		words++;
+		if (words < SHINGLE)
+			continue;
+		h = 0;
+		for (j = 0; j < SHINGLE; j++) {
+			h = (h ^ ring[(words + j) % SHINGLE]) *
+				0xbf58476d1ce4e5b9ULL;
+			h ^= h >> 31;
+		}
+		if (h & SAMPLE)
+			continue;
+		if (cnt >= size) {
+			size = size * 2 + 16;
+			*hp = realloc(*hp, size * sizeof(**hp));
+			if (offp)
+				*offp = realloc(*offp, size * sizeof(**offp));
+			if (!*hp || (offp && !*offp))
+				wiggle_die("memory");
+		}
+		(*hp)[cnt] = h >> 32;
+		if (offp)
+			(*offp)[cnt] = ringoff[words % SHINGLE];
+		cnt++;
+	}
+	return cnt;
+}
+
+static int cmp_hash(const void *av, const void *bv)
+{
+	uint32_t a = *(const uint32_t *)av;
+	uint32_t b = *(const uint32_t *)bv;
+
+	return a < b ? -1 : a > b;
+}
+
+/* Sort hashes and drop duplicates, returning the new count */
+static int unique(uint32_t *h, int cnt)
+{
+	int i, n = 0;
+
+	qsort(h, cnt, sizeof(*h), cmp_hash);
+	for (i = 0; i < cnt; i++)
+		if (n == 0 || h[n-1] != h[i])
+			h[n++] = h[i];
+	return n;
+}
+
+static int has_hash(struct entry *e, uint32_t h)
+{
+	return bsearch(&h, e->hash, e->cnt, sizeof(h), cmp_hash) != NULL;
+}
+
+static int cmp_entry(const void *av, const void *bv)
+{
+	const struct entry *a = av, *b = bv;
+
+	return strcmp(a->path, b->path);
+}
+
+static char *full_path(char *path)
+{
+	char *p;
+
+	asprintf(&p, "%s/%s", wiggle_search_dir, path);
+	return p;
+}
+
+/* Files that would match a hunk only because they hold a copy of it */
+static int ignored(char *name)
+{
+	static char *suffixes[] = {
+		".porig", ".orig", ".rej", ".patch", ".diff", NULL
+	};
+	int len = strlen(name);
+	int i;
+
+	if (name[0] == '.' || strchr(name, '\n'))
+		return 1;
+	for (i = 0; suffixes[i]; i++) {
+		int l = strlen(suffixes[i]);
+
+		if (len > l && strcmp(name + len - l, suffixes[i]) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static void add_entry(struct entry **list, int *cnt, int *size,
+		      struct entry *e)
+{
+	if (*cnt >= *size) {
+		*size = *size * 2 + 64;
+		*list = realloc(*list, *size * sizeof(**list));
+		if (!*list)
+			wiggle_die("memory");
+	}
+	(*list)[(*cnt)++] = *e;
+}
+
+/* Read the index kept from last time, sorted by path */
+static void index_load(struct entry **list, int *cnt)
+{
+	char *name = full_path(INDEX_NAME);
+	FILE *f = fopen(name, "r");
+	char *line = NULL;
+	size_t len = 0;
+	int size = 0;
+
+	free(name);
+	*list = NULL;
+	*cnt = 0;
+	if (!f)
+		return;
+	if (getline(&line, &len, f) <= 0 || strcmp(line, INDEX_MAGIC) != 0)
+		goto out;
+	while (1) {
+		struct entry e;
+		ssize_t l = getline(&line, &len, f);
+		int n = 0, i;
+		char *cp, *end;
+
+		if (l <= 0 || line[l-1] != '\n')
+			break;
+		line[l-1] = 0;
+		if (sscanf(line, "%ld %ld %d %n", &e.mtime, &e.size, &e.cnt,
+			   &n) < 3 || n == 0 || e.cnt < 0)
+			break;
+		e.path = strdup(line + n);
+		e.hash = wiggle_xmalloc((e.cnt + 1) * sizeof(*e.hash));
+		e.seen = 0;
+		l = getline(&line, &len, f);
+		cp = line;
+		for (i = 0; i < e.cnt && l > 0; i++) {
+			e.hash[i] = strtoul(cp, &end, 16);
+			if (end == cp)
+				break;
+			cp = end;
+		}
+		if (l <= 0 || i < e.cnt || *cp != '\n') {
+			free(e.path);
+			free(e.hash);
+			break;
+		}
+		add_entry(list, cnt, &size, &e);
+	}
+	qsort(*list, *cnt, sizeof(**list), cmp_entry);
+out:
+	free(line);
+	fclose(f);
+}
+
+static void index_save(struct entry *list, int cnt)
+{
+	char *name = full_path(INDEX_NAME);
+	char *tmp;
+	FILE *f;
+	int i, j;
+
+	asprintf(&tmp, "%s.tmp", name);
+	f = fopen(tmp, "w");
+	if (!f)
+		/* Not writable: it will all be hashed again next time */
+		goto out;
+	fputs(INDEX_MAGIC, f);
+	for (i = 0; i < cnt; i++) {
+		fprintf(f, "%ld %ld %d %s\n", list[i].mtime, list[i].size,
+			list[i].cnt, list[i].path);
+		for (j = 0; j < list[i].cnt; j++)
+			fprintf(f, "%s%x", j ? " " : "", list[i].hash[j]);
+		fputc('\n', f);
+	}
+	if (fclose(f) != 0 || rename(tmp, name) != 0)
+		unlink(tmp);
+out:
+	free(tmp);
+	free(name);
+}
+
+/* Add each file under 'rel' to the index, reusing the entry in 'old'
+ * if the file hasn't changed.  Returns the number of files hashed.
+ */
+static int index_dir(char *rel, struct entry *old, int ocnt, int *size)
+{
+	char *dirname = rel ? full_path(rel) : strdup(wiggle_search_dir);
+	DIR *dir = opendir(dirname);
+	struct dirent *de;
+	int hashed = 0;
+
+	free(dirname);
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)) != NULL) {
+		struct entry e, *o;
+		struct stat stb;
+		char *full;
+
+		if (ignored(de->d_name))
+			continue;
+		if (rel)
+			asprintf(&e.path, "%s/%s", rel, de->d_name);
+		else
+			e.path = strdup(de->d_name);
+		full = full_path(e.path);
+		if (lstat(full, &stb) != 0) {
+			free(full);
+			free(e.path);
+			continue;
+		}
+		if (S_ISDIR(stb.st_mode)) {
+			free(full);
+			hashed += index_dir(e.path, old, ocnt, size);
+			free(e.path);
+			continue;
+		}
+		if (!S_ISREG(stb.st_mode)) {
+			free(full);
+			free(e.path);
+			continue;
+		}
+		e.mtime = stb.st_mtime;
+		e.size = stb.st_size;
+		e.seen = 0;
+		o = bsearch(&e, old, ocnt, sizeof(e), cmp_entry);
+		if (o && o->mtime == e.mtime && o->size == e.size) {
+			o->seen = 1;
+			e.cnt = o->cnt;
+			e.hash = o->hash;
+		} else {
+			struct stream s = {NULL, 0};
+
+			e.cnt = 0;
+			e.hash = NULL;
+			if (e.size <= MAX_INDEXED)
+				s = wiggle_load_file(full);
+			/* Text files only */
+			if (s.body && !memchr(s.body, 0, s.len)) {
+				e.cnt = shingles(s.body, s.body + s.len,
+						 &e.hash, NULL, 0);
+				e.cnt = unique(e.hash, e.cnt);
+			}
+			free(s.body);
+			hashed++;
+		}
+		free(full);
+		add_entry(&tree, &tree_cnt, size, &e);
+	}
+	closedir(dir);
+	return hashed;
+}
+
+/* Bring the index of wiggle_search_dir up to date, once per run */
+static void index_tree(void)
+{
+	struct entry *old;
+	int ocnt, size = 0;
+	int i, changed;
+
+	if (tree_loaded)
+		return;
+	tree_loaded = 1;
+	index_load(&old, &ocnt);
+	changed = index_dir(NULL, old, ocnt, &size);
+	qsort(tree, tree_cnt, sizeof(*tree), cmp_entry);
+	for (i = 0; i < ocnt; i++) {
+		if (!old[i].seen) {
+			/* Changed or gone */
+			changed = 1;
+			free(old[i].hash);
+		}
+		free(old[i].path);
+	}
+	free(old);
+	if (changed)
+		index_save(tree, tree_cnt);
+}
+
+struct found {
+	int val, size;
+	int first, last;	/* lines */
+};
+
+/* Look for the hunk at b.list[blo..bhi) in the file 'path', only in
+ * the part holding the hashes 'q' which are those of the hunk.
+ */
+static struct found search_file(char *path, struct file b, int blo, int bhi,
+				int type, uint32_t *q, int qcnt)
+{
+	struct found fd = {0, 0, 0, 0};
+	char *full = full_path(path);
+	struct stream s = wiggle_load_file(full);
+	struct stream region;
+	struct file f;
+	uint32_t *h = NULL;
+	int *off = NULL;
+	int cnt, i, j, n, best = 0, bestoff = 0;
+	int hunklen = b.list[bhi-1].start + b.list[bhi-1].plen -
+		b.list[blo+1].start;
+	int lo, hi, xlo, xhi;
+	char *cp;
+
+	free(full);
+	if (!s.body)
+		return fd;
+	/* The most hashes of the hunk within twice its length */
+	cnt = shingles(s.body, s.body + s.len, &h, &off, 0);
+	n = 0;
+	for (i = 0; i < cnt; i++)
+		if (bsearch(&h[i], q, qcnt, sizeof(*q), cmp_hash))
+			off[n++] = off[i];
+	for (i = 0, j = 0; i < n; i++) {
+		while (off[j] < off[i] - 2 * hunklen)
+			j++;
+		if (i - j + 1 > best) {
+			best = i - j + 1;
+			bestoff = off[j];
+		}
+	}
+	free(h);
+	free(off);
+	lo = bestoff - hunklen;
+	hi = bestoff + 3 * hunklen;
+	if (lo < 0)
+		lo = 0;
+	if (hi > s.len)
+		hi = s.len;
+	while (lo > 0 && s.body[lo-1] != '\n')
+		lo--;
+	while (hi < s.len && s.body[hi-1] != '\n')
+		hi++;
+	region.body = s.body + lo;
+	region.len = hi - lo;
+	f = wiggle_split_stream(region, type);
+	fd.val = wiggle_find_hunk(f, b, blo, bhi, &xlo, &xhi, &fd.size);
+	if (fd.val > 0) {
+		/* Don't count the indent of the line after */
+		while (xhi - 1 > xlo && isspace(f.list[xhi-1].start[0]))
+			xhi--;
+		fd.first = fd.last = 1;
+		for (cp = s.body; cp < f.list[xlo].start; cp++)
+			fd.first += *cp == '\n';
+		for (cp = s.body; cp < f.list[xhi-1].start; cp++)
+			fd.last += *cp == '\n';
+	}
+	free(f.list);
+	free(s.body);
+	return fd;
+}
+
+/* Look for the hunk at b.list[blo..bhi) elsewhere in the tree.
+ * If it was 'placed', if poorly, in 'name', only report a much better
+ * match.
+ */
+static void relocate_hunk(char *name, char *target, struct file b,
+			  int blo, int bhi, int type, int placed)
+{
+	uint32_t *q = NULL;
+	int qcnt;
+	int cand[CANDIDATES], score[CANDIDATES];
+	struct found fd[CANDIDATES];
+	int pipes[CANDIDATES];
+	pid_t pids[CANDIDATES];
+	int ncand = 0;
+	int i, j, best = -1;
+
+	qcnt = shingles(b.list[blo+1].start,
+			b.list[bhi-1].start + b.list[bhi-1].plen,
+			&q, NULL, 0);
+	qcnt = unique(q, qcnt);
+	for (i = 0; i < tree_cnt; i++) {
+		int s = 0;
+		char *full;
+
+		for (j = 0; j < qcnt; j++)
+			s += has_hash(&tree[i], q[j]);
+		if (s == 0 || (ncand == CANDIDATES &&
+			       s <= score[CANDIDATES-1]))
+			continue;
+		if (target) {
+			char *real;
+
+			full = full_path(tree[i].path);
+			real = realpath(full, NULL);
+			free(full);
+			if (real && strcmp(real, target) == 0) {
+				free(real);
+				continue;
+			}
+			free(real);
+		}
+		if (ncand < CANDIDATES)
+			ncand++;
+		for (j = ncand - 1; j > 0 && score[j-1] < s; j--) {
+			cand[j] = cand[j-1];
+			score[j] = score[j-1];
+		}
+		cand[j] = i;
+		score[j] = s;
+	}
+
+	/* Search the candidates in parallel */
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < ncand; i++) {
+		int p[2];
+
+		pids[i] = -1;
+		if (pipe(p) == 0) {
+			pids[i] = fork();
+			if (pids[i] < 0) {
+				close(p[0]);
+				close(p[1]);
+			}
+		}
+		if (pids[i] <= 0)
+			fd[i] = search_file(tree[cand[i]].path, b, blo, bhi,
+					    type, q, qcnt);
+		if (pids[i] == 0) {
+			if (write(p[1], &fd[i], sizeof(fd[i])) != sizeof(fd[i]))
+				_exit(1);
+			_exit(0);
+		}
+		if (pids[i] > 0) {
+			close(p[1]);
+			pipes[i] = p[0];
+		}
+	}
+	for (i = 0; i < ncand; i++) {
+		if (pids[i] > 0) {
+			if (read(pipes[i], &fd[i], sizeof(fd[i])) !=
+			    sizeof(fd[i]))
+				fd[i].val = 0;
+			close(pipes[i]);
+			waitpid(pids[i], NULL, 0);
+		}
+		/* A perfect match is worth about 3 for each word, so
+		 * this is a third of the hunk, or two thirds if it
+		 * was placed.
+		 */
+		if (fd[i].val >= fd[i].size * (placed ? 2 : 1) &&
+		    (best < 0 || fd[i].val > fd[best].val))
+			best = i;
+	}
+	free(q);
+
+	if (best >= 0)
+		fprintf(stderr, "%s: hunk %d of %s has moved to %s:%d-%d\n",
+			wiggle_Cmd, (int)b.list[blo].hash, name,
+			tree[cand[best]].path, fd[best].first, fd[best].last);
+	else if (!placed)
+		fprintf(stderr, "%s: hunk %d of %s not found in %s either\n",
+			wiggle_Cmd, (int)b.list[blo].hash, name,
+			wiggle_search_dir);
+}
+
+/* 'b' is the 'before' text of a patch for 'name', split by 'type',
+ * and 'csl' is where wiggle_pdiff() placed it.  Any hunk of which less
+ * than half was matched is looked for in wiggle_search_dir: when code
+ * has moved, wiggle_pdiff() often finds a few words of it somewhere
+ * rather than losing it altogether.  If 'csl' is NULL then 'name'
+ * doesn't exist and every hunk is looked for.
+ */
+void wiggle_relocate(char *name, struct file b, struct csl *csl, int type)
+{
+	char *target = NULL;
+	struct csl *c;
+	int looked = 0;
+	int i, j, hi;
+
+	for (i = 0; i < b.elcnt; i = hi) {
+		int matched = 0, words = 0;
+
+		hi = i + 1;
+		while (hi < b.elcnt && b.list[hi].start[0])
+			hi++;
+		if (b.list[i].start[0] || hi - i <= 1)
+			/* Not a hunk, or only adds lines */
+			continue;
+		for (j = i + 1; j < hi; j++)
+			words += word(b.list[j]);
+		while (csl && csl->len && csl->b + csl->len <= i)
+			csl++;
+		for (c = csl; c && c->len && c->b < hi; c++)
+			for (j = max(c->b, i); j < min(c->b + c->len, hi); j++)
+				matched += word(b.list[j]);
+		if (matched * 2 >= words)
+			continue;
+		if (!looked) {
+			index_tree();
+			target = realpath(name, NULL);
+			looked = 1;
+		}
+		relocate_hunk(name, target, b, i, hi, type, matched > 0);
+	}
+	free(target);
+}
@@ -0,0 +1,359 @@
+/*
+ * wiggle - apply rejected patches
+ *
+ * Copyright (C) 2003 Neil Brown <neilb@cse.unsw.edu.au>
+ * Copyright (C) 2010-2013 Neil Brown <neilb@suse.de>
+ * Copyright (C) 2014-2020 Neil Brown <neil@brown.name>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.
+ *
+ *    Author: Neil Brown
+ *    Email: <neil@brown.name>
+ */
+
+/*
+ * Replace a file with a newly written version, optionally keeping
+ * the original as name.porig.
+ *
+ * When --replace is applied across a large tree, the cost is mostly
+ * in walking paths and creating and renaming files, so:
+ *  - the directory of the last file is kept open and everything is
+ *    done relative to it with the *at() calls;
+ *  - where the kernel supports O_TMPFILE, the new file is created
+ *    without a name, so an interrupted run leaves no temporary file
+ *    behind; it is only linked to a temporary name once complete;
+ *  - data is only flushed to storage as wiggle_sync_mode asks: not at
+ *    all, with fsync() of each file and its directory, or with one
+ *    syncfs() of each filesystem written to when wiggle exits.
+ *
+ * So that a crash can never leave no file at the original name, the
+ * original is hard-linked to name.porig, and then the new file is
+ * renamed over the original, which is atomic.
+ */
+
+#define _GNU_SOURCE /* for O_TMPFILE and syncfs */
+#include	"wiggle.h"
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<stdlib.h>
+#include	<sys/stat.h>
+#include	<sys/time.h>
+
+int wiggle_sync_mode = SyncNone;
+
+/* The directory of the most recently replaced file */
+static char *lastdir;
+static int lastdirfd = -1;
+
+/* For SyncBatch, one open file on each filesystem written to */
+static struct syncfd {
+	dev_t dev;
+	int fd;
+} *syncfds;
+static int nsyncfds;
+
+static int get_dirfd(char *file, char **basep)
+{
+	char *slash = strrchr(file, '/');
+	int len;
+
+	if (!slash) {
+		*basep = file;
+		return AT_FDCWD;
+	}
+	*basep = slash + 1;
+	len = slash - file;
+	if (len == 0)
+		/* file in "/" */
+		len = 1;
+	if (lastdir && (int)strlen(lastdir) == len &&
+	    strncmp(lastdir, file, len) == 0)
+		return lastdirfd;
+	if (lastdirfd >= 0)
+		close(lastdirfd);
+	free(lastdir);
+	lastdir = strndup(file, len);
+	lastdirfd = open(lastdir, O_RDONLY | O_DIRECTORY);
+	if (lastdirfd < 0) {
+		free(lastdir);
+		lastdir = NULL;
+	}
+	return lastdirfd;
+}
+
+/* Replace the last six characters of 'name' with random ones */
+static void randomise(char *name)
+{
+	char *x = name + strlen(name) - 6;
+	static unsigned int seq;
+	static int seeded;
+	unsigned int r;
+	int i;
+
+	if (!seeded) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		srandom(tv.tv_sec ^ (tv.tv_usec << 12) ^ (getpid() << 16));
+		seeded = 1;
+	}
+	r = (getpid() << 10) ^ (seq++ * 2654435761U) ^ random();
+	for (i = 0; i < 6; i++, r /= 36)
+		x[i] = "abcdefghijklmnopqrstuvwxyz0123456789"[r % 36];
+}
+
+/* Like mkstemp(), but relative to 'dirfd' */
+static int mkstempat(int dirfd, char *name)
+{
+	int tries;
+
+	for (tries = 0; tries < 100; tries++) {
+		int fd;
+
+		randomise(name);
+		fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0 || errno != EEXIST)
+			return fd;
+	}
+	return -1;
+}
+
+/* Give the O_TMPFILE file 'fd' a random name like mkstempat() would */
+static int link_tmpfile(int fd, int dirfd, char *name)
+{
+	char path[40];
+	int tries;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	for (tries = 0; tries < 100; tries++) {
+		randomise(name);
+		if (linkat(AT_FDCWD, path, dirfd, name,
+			   AT_SYMLINK_FOLLOW) == 0)
+			return 0;
+		if (errno != EEXIST)
+			return -1;
+	}
+	return -1;
+}
+
+/* Prepare to write a replacement for 'file'.  Without a backup,
+ * 'file' need not exist yet.
+ * If 'check' is set and a backup is wanted, fail with errno
+ * set to EEXIST if file.porig already exists.
+ * Returns NULL with errno set on failure.
+ */
+FILE *wiggle_replace_open(struct replace *r, char *file, int backup,
+			  int check)
+{
+	static int have_proc = -1;
+	struct stat stb;
+	int fd = -1;
+
+	memset(r, 0, sizeof(*r));
+	r->file = file;
+	r->backup = backup;
+	r->dirfd = get_dirfd(file, &r->base);
+	if (r->dirfd == -1)
+		return NULL;
+	r->porig = wiggle_xmalloc(strlen(r->base) + 7);
+	strcpy(r->porig, r->base);
+	strcat(r->porig, ".porig");
+	if (check && backup &&
+	    (fstatat(r->dirfd, r->porig, &stb, AT_SYMLINK_NOFOLLOW) == 0 ||
+	     errno != ENOENT)) {
+		free(r->porig);
+		errno = EEXIST;
+		return NULL;
+	}
+
+	r->tmpname = wiggle_xmalloc(strlen(r->base) + 7);
+	strcpy(r->tmpname, r->base);
+	strcat(r->tmpname, "XXXXXX");
+#ifdef O_TMPFILE
+	/* Linking a nameless file needs /proc */
+	if (have_proc < 0)
+		have_proc = access("/proc/self/fd", X_OK) == 0;
+	if (have_proc) {
+		fd = openat(r->dirfd, ".", O_TMPFILE | O_WRONLY, 0600);
+		r->tmpfile = fd >= 0;
+	}
+#endif
+	if (fd < 0)
+		fd = mkstempat(r->dirfd, r->tmpname);
+	if (fd < 0 || (r->out = fdopen(fd, "w")) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		free(r->tmpname);
+		free(r->porig);
+		return NULL;
+	}
+	return r->out;
+}
+
+static void sync_batch(void)
+{
+	int i;
+
+	for (i = 0; i < nsyncfds; i++) {
+#ifdef __linux__
+		if (syncfs(syncfds[i].fd) != 0)
+			fprintf(stderr, "%s: syncfs failed - %s\n",
+				wiggle_Cmd, strerror(errno));
+#else
+		sync();
+#endif
+		close(syncfds[i].fd);
+	}
+	nsyncfds = 0;
+}
+
+/* Remember a file on this filesystem so it can be synced at exit */
+static void add_syncfd(int fd)
+{
+	struct stat stb;
+	int i;
+
+	if (fstat(fd, &stb) != 0)
+		return;
+	for (i = 0; i < nsyncfds; i++)
+		if (syncfds[i].dev == stb.st_dev)
+			return;
+	if (!syncfds)
+		atexit(sync_batch);
+	syncfds = realloc(syncfds, (nsyncfds + 1) * sizeof(*syncfds));
+	if (!syncfds)
+		wiggle_die("memory allocation");
+	syncfds[nsyncfds].dev = stb.st_dev;
+	syncfds[nsyncfds].fd = dup(fd);
+	nsyncfds++;
+}
+
+static void replace_free(struct replace *r)
+{
+	free(r->tmpname);
+	free(r->porig);
+	r->out = NULL;
+}
+
+/* Give up on the replacement, leaving the original untouched */
+void wiggle_replace_abort(struct replace *r)
+{
+	fclose(r->out);
+	if (!r->tmpfile)
+		unlinkat(r->dirfd, r->tmpname, 0);
+	replace_free(r);
+}
+
+/* Keep the original as name.porig.  It is linked there rather than
+ * moved, so there is a file at the original name throughout.  Where
+ * the filesystem has no hard links, it is moved after all.
+ */
+static int backup_original(struct replace *r)
+{
+	if (linkat(r->dirfd, r->base, r->dirfd, r->porig, 0) == 0)
+		return 0;
+	if (errno == EEXIST) {
+		/* Only the browser replaces an existing backup */
+		if (unlinkat(r->dirfd, r->porig, 0) != 0)
+			return -1;
+		if (linkat(r->dirfd, r->base, r->dirfd, r->porig, 0) == 0)
+			return 0;
+	}
+	if (errno != EPERM && errno != ENOTSUP && errno != EOPNOTSUPP &&
+	    errno != EMLINK)
+		return -1;
+	r->moved = 1;
+	return renameat(r->dirfd, r->base, r->dirfd, r->porig);
+}
+
+/* Make the names just changed in 'dirfd' durable */
+static int sync_dir(int dirfd)
+{
+	int fd = dirfd, ret;
+
+	if (dirfd == AT_FDCWD)
+		fd = open(".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+	ret = fsync(fd);
+	if (fd != dirfd)
+		close(fd);
+	return ret;
+}
+
+/* Move the new file into place, backing up the original if asked.
+ * Returns 0 on success, or -1 with r->failed describing what
+ * could not be done.
+ */
+int wiggle_replace_commit(struct replace *r)
+{
+	struct stat stb;
+	int fd = fileno(r->out);
+
+	if (fstatat(r->dirfd, r->base, &stb, 0) != 0) {
+		mode_t mask = umask(0);
+
+		umask(mask);
+		r->failed = "stat original file";
+		if (errno != ENOENT || r->backup)
+			goto abort;
+		/* A new file, as open() would create it */
+		stb.st_mode = 0666 & ~mask;
+	}
+	if (fchmod(fd, stb.st_mode) != 0) {
+		r->failed = "change permission of new file";
+		goto abort;
+	}
+	if (fflush(r->out) != 0) {
+		r->failed = "write new file";
+		goto abort;
+	}
+	if (wiggle_sync_mode == SyncFile && fsync(fd) != 0) {
+		r->failed = "sync new file";
+		goto abort;
+	}
+	if (wiggle_sync_mode == SyncBatch)
+		add_syncfd(fd);
+
+	if (r->tmpfile) {
+		r->failed = "link new file";
+		if (link_tmpfile(fd, r->dirfd, r->tmpname) != 0)
+			goto abort;
+		r->tmpfile = 0;
+	}
+	r->failed = "back up original file";
+	if (r->backup && backup_original(r) != 0)
+		goto abort;
+	r->failed = "move new file into place";
+	if (renameat(r->dirfd, r->tmpname, r->dirfd, r->base) != 0)
+		goto restore;
+	r->failed = NULL;
+	if (wiggle_sync_mode == SyncFile && sync_dir(r->dirfd) != 0)
+		r->failed = "sync directory";
+	if (fclose(r->out) != 0)
+		r->failed = "close new file";
+	replace_free(r);
+	return r->failed ? -1 : 0;
+
+restore:
+	if (r->backup && r->moved)
+		renameat(r->dirfd, r->porig, r->dirfd, r->base);
+	else if (r->backup)
+		unlinkat(r->dirfd, r->porig, 0);
+abort:
+	wiggle_replace_abort(r);
+	return -1;
+}
@@ -47,8 +47,6 @@
 #include	<ctype.h>
 #include	<stdlib.h>
 
-#include "ccan/hash/hash.h"
-
 static int wiggle_split_internal(char *start, char *end, int type,
 			  struct elmnt *list)
 {
@@ -145,7 +143,7 @@ static int wiggle_split_internal(char *start, char *end, int type,
 			list->plen = cp2-start;
 			list->prefix = prefix;
 			if (*start)
-				list->hash = hash(start, list->len, 0);
+				list->hash = wiggle_hash(start, list->len);
 			else
 				list->hash = atoi(start+1);
 			list++;
@@ -156,6 +154,14 @@ static int wiggle_split_internal(char *start, char *end, int type,
 	return cnt;
 }
 
+/* The number of elements wiggle_split_stream() would produce */
+int wiggle_count_stream(struct stream s, int type)
+{
+	if (!s.body)
+		return 0;
+	return wiggle_split_internal(s.body, s.body + s.len, type, NULL);
+}
+
 struct file wiggle_split_stream(struct stream s, int type)
 {
 	int cnt;
@@ -27,11 +27,83 @@
 #include	<unistd.h>
 #include	<stdlib.h>
 #include	<sys/stat.h>
+#include	<time.h>
 
 char *wiggle_Cmd = "wiggle";
 
 int wiggle_do_trace = 0;
 
+/* If WIGGLE_TRACE_FD names an open file descriptor, events describing
+ * how each hunk was placed are written to it, one JSON object per line.
+ */
+FILE *wiggle_trace_file = NULL;
+/* The file being merged, named in each event */
+char *wiggle_trace_name = NULL;
+
+/* Begin a trace event of kind 'event'.  The caller adds the rest of
+ * the fields, each preceded by a comma, and the closing brace.
+ */
+void wiggle_trace_event(char *event)
+{
+	char *c = wiggle_trace_name;
+
+	fprintf(wiggle_trace_file, "{\"event\":\"%s\",\"file\":", event);
+	if (!c) {
+		fputs("null", wiggle_trace_file);
+		return;
+	}
+	putc('"', wiggle_trace_file);
+	for (; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(wiggle_trace_file, "\\%c", *c);
+		else if ((unsigned char)*c < ' ')
+			fprintf(wiggle_trace_file, "\\u%04x", *c);
+		else
+			putc(*c, wiggle_trace_file);
+	}
+	putc('"', wiggle_trace_file);
+}
+
+/* Microseconds since some fixed time, for timing trace events */
+long wiggle_trace_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* If not zero, a merge which is expected to need more memory than this
+ * falls back to a coarser granularity.
+ */
+long wiggle_max_memory = 0;
+
+/* The long loops in diff.c and bestmatch.c report their progress
+ * through wiggle_progress().  Every WIGGLE_PROGRESS_STEPS diagonals
+ * it calls wiggle_progress_hook, if one is set, which can return
+ * WIGGLE_HURRY to ask for the rest of the work to be done as quickly
+ * as possible, at the cost of a poorer result, or WIGGLE_CANCEL when
+ * the result isn't wanted at all and only needs to be safe to free.
+ * That request stays in effect until the caller clears wiggle_hurry.
+ */
+int (*wiggle_progress_hook)(long steps);
+int wiggle_hurry = 0;
+
+int wiggle_progress(long steps)
+{
+	static long pending;
+	int ret;
+
+	pending += steps;
+	if (pending < WIGGLE_PROGRESS_STEPS)
+		return wiggle_hurry;
+	ret = wiggle_progress_hook(pending);
+	if (ret > wiggle_hurry)
+		wiggle_hurry = ret;
+	pending = 0;
+	return wiggle_hurry;
+}
+
 void *wiggle_xmalloc(int size)
 {
 	void *rv = malloc(size);
@@ -45,16 +45,119 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 
 static void term_init(int raw);
 
 static int intr_kills = 0;
 
+/* With --self-test, WIGGLE_SELFTEST_KEYS can give keystrokes to use
+ * first, in the list of files or before the usual 'n's in a merge.
+ * Needing more than it gives is an error.  A '!' in it gives up on the
+ * next merge as though 'q' had been pressed while it was computed.
+ */
+static char *selftest_keys;
+static int selftest_cancel;
+
+static int selftest_getch(void)
+{
+	while (selftest_keys && *selftest_keys == '!') {
+		selftest_cancel = 1;
+		selftest_keys++;
+	}
+	if (!selftest_keys)
+		return getch();
+	if (*selftest_keys)
+		return *selftest_keys++;
+	endwin();
+	fprintf(stderr, "%s: ran out of WIGGLE_SELFTEST_KEYS\n", wiggle_Cmd);
+	exit(2);
+}
+
+/******************************************************************
+ * Progress of slow merges.
+ * Once a merge has been running for a while, show how far it has
+ * got on the bottom line and check for a key asking for it to
+ * hurry up or be abandoned.
+ */
+static struct timeval progress_begin;
+static long progress_steps;
+/* Set when a merge is given up on.  Whoever called run_merge() must
+ * check it, discard the merge, and clear it.
+ */
+static int progress_abort;
+
+static void progress_start(void)
+{
+	gettimeofday(&progress_begin, NULL);
+	progress_steps = 0;
+	progress_abort = 0;
+	wiggle_hurry = 0;
+	if (selftest_cancel) {
+		selftest_cancel = 0;
+		progress_abort = 1;
+		wiggle_hurry = WIGGLE_CANCEL;
+	}
+}
+
+static int show_progress(long steps)
+{
+	struct timeval now;
+	long ms;
+	int c;
+
+	progress_steps += steps;
+	if (!stdscr || isendwin())
+		return WIGGLE_CONTINUE;
+	gettimeofday(&now, NULL);
+	ms = (now.tv_sec - progress_begin.tv_sec) * 1000 +
+		(now.tv_usec - progress_begin.tv_usec) / 1000;
+	if (ms < 500)
+		return WIGGLE_CONTINUE;
+
+	attrset(A_STANDOUT);
+	mvprintw(LINES-1, 0, "Computing merge: %ld.%lds, %ldM steps",
+		 ms / 1000, (ms / 100) % 10, progress_steps >> 20);
+	attrset(A_NORMAL);
+	addstr("  f: faster  q: give up");
+	clrtoeol();
+	refresh();
+
+	nodelay(stdscr, TRUE);
+	c = getch();
+	nodelay(stdscr, FALSE);
+	switch (c) {
+	case ERR:
+		break;
+	case 'q':
+	case 27:
+		progress_abort = 1;
+		return WIGGLE_CANCEL;
+	case 'f':
+		return WIGGLE_HURRY;
+	default:
+		/* Leave it for whoever asks next */
+		ungetch(c);
+	}
+	return WIGGLE_CONTINUE;
+}
+
 /* global attributes */
 static unsigned int a_delete, a_added, a_common, a_sep, a_void,
 	a_unmatched, a_extra, a_already;
 static unsigned int a_has_conflicts, a_has_wiggles, a_no_wiggles, a_saved;
 
+/* How to split and diff the streams of a merge - see wiggle_plan() */
+static void plan_merge(struct stream sm, struct stream sb, struct stream sa,
+		       int chunks, int ignore_blanks, int *type, int *flags)
+{
+	struct stream s[3] = { sm, sb, sa };
+
+	*type = ByWord | ignore_blanks;
+	*flags = DiffShortest;
+	wiggle_plan(s, type, flags, chunks);
+}
+
 /******************************************************************
  * Help window
  * We display help in an insert, leaving 5 columns left and right,
@@ -183,7 +286,7 @@ static int help_window(char *page1[], char *page2[], int query)
 			}
 		}
 		move(top+rows-1, left);
-		ch = getch();
+		ch = selftest_getch();
 
 		switch (ch) {
 		case 'C' - 64:
@@ -1243,6 +1346,12 @@ static char *merge_window_help[] = {
 	" X                   Revert 'c' and 'x' changes on this line",
 	" v                   Save the current merge and run the",
 	"                     default editor on the file.",
+	"",
+	"If a merge takes a long time to compute, progress is",
+	"shown on the bottom line, and:",
+	" f                   finishes it quickly, with a poorer",
+	"                     result",
+	" q  ESC              gives up on opening the file",
 	NULL
 };
 static char *save_query[] = {
@@ -1296,35 +1405,21 @@ static void *memdup(void *a, int len)
 static int save_merge(struct file a, struct file b, struct file c,
 		      struct merge *merger, char *file, int backup)
 {
-	char *replacename = wiggle_xmalloc(strlen(file) + 20);
-	char *orignew = wiggle_xmalloc(strlen(file) + 20);
-	int fd;
+	struct replace rp;
 	FILE *outfile;
-	int err = 0;
-	int lineno = 0;
-	strcpy(replacename, file);
-	strcat(replacename, "XXXXXX");
-	strcpy(orignew, file);
-	strcat(orignew, ".porig");
-
-	fd = mkstemp(replacename);
-	if (fd < 0) {
-		err = -1;
-		goto out;
-	}
-	outfile = fdopen(fd, "w");
+	int lineno;
+
+	if (wiggle_file_compressed(file))
+		/* The merge would be saved uncompressed */
+		return -1;
+	outfile = wiggle_replace_open(&rp, file, backup, 0);
+	if (!outfile)
+		return -1;
 	lineno = wiggle_print_merge(outfile, &a, &b, &c, 0, merger,
 				    NULL, 0, 0);
-	fclose(outfile);
-	if (backup && rename(file, orignew) != 0)
-		err = -2;
-	else if (rename(replacename, file) != 0)
-		err = -2;
-
-out:
-	free(replacename);
-	free(orignew);
-	return err < 0 ? err : lineno;
+	if (wiggle_replace_commit(&rp) != 0)
+		return -2;
+	return lineno;
 }
 
 static int save_tmp_merge(struct file a, struct file b, struct file c,
@@ -1369,6 +1464,256 @@ static int save_tmp_merge(struct file a, struct file b, struct file c,
 	return lineno;
 }
 
+/* Merges computed for files in a patch are kept, so that counting the
+ * conflicts, viewing the file and saving it don't each repeat the work.
+ * A merge is only in the cache while nobody is using it: merge_window()
+ * takes it out while it is displayed and puts it back, without any edits,
+ * when done.  The least recently used are freed to keep the total below
+ * --max-memory, or MERGE_CACHE_LIMIT.
+ */
+#define MERGE_CACHE_LIMIT (64L << 20)
+
+struct merge_state {
+	struct plist *pl;
+	FILE *f; /* patch the hunks came from, or NULL */
+	int ignore_blanks, just_diff;
+	struct stream sm, sb, sa;
+	struct file fm, fb, fa;
+	struct csl *csl1, *csl2;
+	struct ci ci;
+	int ch; /* count of chunks */
+	int hurried;
+	long size;
+	struct merge_state *next; /* next less recently used */
+};
+static struct merge_state *merge_cache;
+static long merge_cache_size;
+
+/* Load the original, before and after text for 'p', either from the
+ * patch 'f' or, if f is NULL, from p's files.
+ * Returns the number of chunks in the patch, or -1 if the original
+ * could not be loaded or -2 if the patch is corrupt.
+ */
+static int load_streams(struct plist *p, FILE *f, int reverse, int just_diff,
+			struct stream *sm, struct stream *sb, struct stream *sa)
+{
+	struct stream sp;
+	int ch = 0;
+
+	if (f == NULL) {
+		if (!p->is_merge) {
+			/* three separate files */
+			*sb = wiggle_load_file(p->before);
+			*sa = wiggle_load_file(p->after);
+			if (just_diff)
+				*sm = *sb;
+			else
+				*sm = wiggle_load_file(p->file);
+		} else {
+			/* One merge file */
+			sp = wiggle_load_file(p->file);
+			if (reverse)
+				wiggle_split_merge(sp, sm, sa, sb);
+			else
+				wiggle_split_merge(sp, sm, sb, sa);
+			free(sp.body);
+		}
+	} else {
+		sp = wiggle_load_segment(f, p->start, p->end);
+		if (p->is_merge) {
+			if (reverse)
+				wiggle_split_merge(sp, sm, sa, sb);
+			else
+				wiggle_split_merge(sp, sm, sb, sa);
+		} else {
+			if (reverse)
+				ch = wiggle_split_patch(sp, sa, sb);
+			else
+				ch = wiggle_split_patch(sp, sb, sa);
+			if (just_diff)
+				*sm = *sb;
+			else
+				*sm = wiggle_load_file(p->file);
+		}
+		free(sp.body);
+	}
+	if (!sm->body || !sb->body || !sa->body) {
+		ch = sm->body ? -2 : -1;
+		if (sm->body != sb->body)
+			free(sm->body);
+		free(sb->body);
+		free(sa->body);
+	}
+	return ch;
+}
+
+static void merge_free(struct merge_state *ms)
+{
+	free(ms->fm.list);
+	free(ms->fb.list);
+	free(ms->fa.list);
+	free(ms->csl1);
+	free(ms->csl2);
+	free(ms->ci.merger);
+	if (ms->sm.body != ms->sb.body)
+		free(ms->sm.body);
+	free(ms->sb.body);
+	free(ms->sa.body);
+	free(ms);
+}
+
+/* Compute the merge of the streams, which the result then owns */
+static struct merge_state *run_merge(struct plist *p, FILE *f,
+				     struct stream sm, struct stream sb,
+				     struct stream sa, int ch,
+				     int ignore_blanks, int just_diff)
+{
+	struct merge_state *ms = wiggle_xmalloc(sizeof(*ms));
+	struct csl *c;
+	int type, dflags;
+	int i;
+
+	ms->pl = p;
+	ms->f = f;
+	ms->ignore_blanks = ignore_blanks;
+	ms->just_diff = just_diff;
+	ms->sm = sm;
+	ms->sb = sb;
+	ms->sa = sa;
+	ms->ch = ch;
+
+	progress_start();
+	wiggle_trace_name = p->file;
+	plan_merge(sm, sb, sa, just_diff ? 0 : ch, ignore_blanks,
+		   &type, &dflags);
+	/* FIXME check for errors in the stream */
+	ms->fm = wiggle_split_stream(sm, type);
+	ms->fb = wiggle_split_stream(sb, type);
+	ms->fa = wiggle_split_stream(sa, type);
+
+	if (ch && !just_diff)
+		ms->csl1 = wiggle_pdiff(ms->fm, ms->fb, ch);
+	else
+		ms->csl1 = wiggle_diff(ms->fm, ms->fb, dflags);
+	ms->csl2 = wiggle_diff_patch(ms->fb, ms->fa, dflags);
+	if (progress_abort) {
+		/* The diffs were cut short, so don't bother merging them */
+		memset(&ms->ci, 0, sizeof(ms->ci));
+		return ms;
+	}
+
+	ms->ci = wiggle_make_merger(ms->fm, ms->fb, ms->fa,
+				    ms->csl1, ms->csl2, 0, 1, 0);
+	for (i = 0; ms->ci.merger[i].type != End; i++)
+		ms->ci.merger[i].oldtype = ms->ci.merger[i].type;
+	ms->hurried = wiggle_hurry;
+
+	ms->size = sizeof(*ms) + sm.len + sb.len + sa.len;
+	ms->size += (ms->fm.elcnt + ms->fb.elcnt + ms->fa.elcnt) *
+		sizeof(struct elmnt);
+	for (c = ms->csl1; c->len; c++)
+		ms->size += sizeof(*c);
+	for (c = ms->csl2; c->len; c++)
+		ms->size += sizeof(*c);
+	ms->size += (i + 1) * sizeof(struct merge);
+	return ms;
+}
+
+/* Take the merge of 'p' out of the cache, if it is there */
+static struct merge_state *cache_take(struct plist *p, FILE *f,
+				      int ignore_blanks, int just_diff)
+{
+	struct merge_state **msp, *ms;
+
+	for (msp = &merge_cache; *msp; msp = &(*msp)->next) {
+		ms = *msp;
+		if (ms->pl == p && ms->f == f &&
+		    ms->ignore_blanks == ignore_blanks &&
+		    ms->just_diff == just_diff) {
+			*msp = ms->next;
+			merge_cache_size -= ms->size;
+			return ms;
+		}
+	}
+	return NULL;
+}
+
+/* Discard any 'x', 'c' or 'X' edits made to a merge.  Restoring the
+ * types isn't enough: in_conflict, lo and hi, and the counts, all
+ * depend on them, so the conflicts must be isolated again too.
+ */
+static void merge_revert(struct merge_state *ms)
+{
+	int i;
+
+	for (i = 0; ms->ci.merger[i].type != End; i++)
+		if (ms->ci.merger[i].type != ms->ci.merger[i].oldtype)
+			break;
+	if (ms->ci.merger[i].type == End)
+		return;
+	for (; ms->ci.merger[i].type != End; i++)
+		ms->ci.merger[i].type = ms->ci.merger[i].oldtype;
+	ms->ci.wiggles = 0;
+	ms->ci.conflicts = wiggle_isolate_conflicts(
+		ms->fm, ms->fb, ms->fa, ms->csl1, ms->csl2, 0,
+		ms->ci.merger, 0, &ms->ci.wiggles);
+}
+
+/* Put a merge in the cache as the most recently used, discarding
+ * any edits made to it.
+ */
+static void cache_put(struct merge_state *ms)
+{
+	long limit = wiggle_max_memory ? wiggle_max_memory : MERGE_CACHE_LIMIT;
+	struct merge_state **msp;
+
+	merge_revert(ms);
+	ms->next = merge_cache;
+	merge_cache = ms;
+	merge_cache_size += ms->size;
+
+	/* Free from the least recently used end */
+	while (merge_cache_size > limit) {
+		for (msp = &merge_cache; (*msp)->next; msp = &(*msp)->next)
+			;
+		merge_cache_size -= (*msp)->size;
+		merge_free(*msp);
+		*msp = NULL;
+	}
+}
+
+/* Forget all merges of 'p', or of everything if p is NULL */
+static void cache_forget(struct plist *p)
+{
+	struct merge_state **msp = &merge_cache, *ms;
+
+	while ((ms = *msp) != NULL) {
+		if (p && ms->pl != p) {
+			msp = &ms->next;
+			continue;
+		}
+		*msp = ms->next;
+		merge_cache_size -= ms->size;
+		merge_free(ms);
+	}
+}
+
+/* Merge the same text as 'ms' with a different ignore_blanks */
+static struct merge_state *remerge(struct merge_state *ms, int ignore_blanks)
+{
+	struct stream sm = ms->sm, sb = ms->sb, sa = ms->sa;
+
+	/* Each merge owns its text */
+	sb.body = memdup(sb.body, sb.len);
+	sa.body = memdup(sa.body, sa.len);
+	if (ms->sm.body == ms->sb.body)
+		sm = sb;
+	else
+		sm.body = memdup(sm.body, sm.len);
+	return run_merge(ms->pl, ms->f, sm, sb, sa, ms->ch,
+			 ignore_blanks, ms->just_diff);
+}
+
 static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 			int selftest, int ignore_blanks, int just_diff, int backup)
 {
@@ -1390,6 +1735,8 @@ static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 	struct csl *csl1, *csl2;
 	struct ci ci;
 	int ch; /* count of chunks */
+	struct merge_state *ms, *old; /* the merge, from or for the cache */
+	int nocache = 0; /* The text has been changed with 'v' */
 	/* Always refresh the current line.
 	 * If refresh == 1, refresh all lines.  If == 2, clear first
 	 */
@@ -1447,14 +1794,33 @@ static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 		unsigned int searchlen;
 	} *anchor = NULL;
 
-	#define free_stuff(none) \
+	/* Finished with the merge: keep it unless it has been saved
+	 * or doesn't match the files any more.
+	 */
+	#define release_merge(saved) \
 	do { \
-		free(fm.list); \
-		free(fb.list); \
-		free(fa.list); \
-		free(csl1); \
-		free(csl2); \
-		free(ci.merger); \
+		if (saved || nocache) \
+			merge_free(ms); \
+		else \
+			cache_put(ms); \
+		if (saved) \
+			cache_forget(p); \
+	} while(0)
+
+	#define use_merge(none) \
+	do { \
+		sm = ms->sm; \
+		sb = ms->sb; \
+		sa = ms->sa; \
+		fm = ms->fm; \
+		fb = ms->fb; \
+		fa = ms->fa; \
+		csl1 = ms->csl1; \
+		csl2 = ms->csl2; \
+		ci = ms->ci; \
+		ch = ms->ch; \
+		if (ms->hurried) \
+			mesg = "Merge was hurried and may be poor"; \
 	} while(0)
 
 	#define find_line(ln) \
@@ -1470,83 +1836,34 @@ static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 		while (pos.p.lineno < ln && ci.merger[pos.p.m].type != End); \
 	} while(0)
 
-	#define prepare_merge(ch) \
-	do { \
-		/* FIXME check for errors in the stream */ \
-		fm = wiggle_split_stream(sm, ByWord | ignore_blanks); \
-		fb = wiggle_split_stream(sb, ByWord | ignore_blanks); \
-		fa = wiggle_split_stream(sa, ByWord | ignore_blanks); \
-\
-		if (ch && !just_diff) \
-			csl1 = wiggle_pdiff(fm, fb, ch); \
-		else \
-			csl1 = wiggle_diff(fm, fb, 1); \
-		csl2 = wiggle_diff_patch(fb, fa, 1); \
-\
-		ci = wiggle_make_merger(fm, fb, fa, csl1, csl2, 0, 1, 0); \
-		for (i = 0; ci.merger[i].type != End; i++) \
-			ci.merger[i].oldtype = ci.merger[i].type; \
-	} while(0)
-
 	if (selftest) {
 		intr_kills = 1;
 		selftest = 1;
 	}
 
-	if (f == NULL) {
-		if (!p->is_merge) {
-			/* three separate files */
-			sb = wiggle_load_file(p->before);
-			sa = wiggle_load_file(p->after);
-			if (just_diff)
-				sm = sb;
+	ms = cache_take(p, f, ignore_blanks, just_diff);
+	if (!ms) {
+		ch = load_streams(p, f, reverse, just_diff, &sm, &sb, &sa);
+		if (ch < 0) {
+			term_init(1);
+			if (ch == -1)
+				help_window(help_missing, NULL, 0);
 			else
-				sm = wiggle_load_file(p->file);
-		} else {
-			/* One merge file */
-			sp = wiggle_load_file(p->file);
-			if (reverse)
-				wiggle_split_merge(sp, &sm, &sa, &sb);
-			else
-				wiggle_split_merge(sp, &sm, &sb, &sa);
-			free(sp.body);
+				help_window(help_corrupt, NULL, 0);
+			endwin();
+			return 0;
 		}
-		ch = 0;
-	} else {
-		sp = wiggle_load_segment(f, p->start, p->end);
-		if (p->is_merge) {
-			if (reverse)
-				wiggle_split_merge(sp, &sm, &sa, &sb);
-			else
-				wiggle_split_merge(sp, &sm, &sb, &sa);
-			ch = 0;
-		} else {
-			if (reverse)
-				ch = wiggle_split_patch(sp, &sa, &sb);
-			else
-				ch = wiggle_split_patch(sp, &sb, &sa);
-			if (just_diff)
-				sm = sb;
-			else
-				sm = wiggle_load_file(p->file);
+		term_init(!selftest);
+		ms = run_merge(p, f, sm, sb, sa, ch, ignore_blanks, just_diff);
+		if (progress_abort) {
+			progress_abort = 0;
+			merge_free(ms);
+			endwin();
+			return 0;
 		}
-		free(sp.body);
-	}
-	if (!sm.body || !sb.body || !sa.body) {
-		if (!just_diff)
-			free(sm.body);
-		free(sb.body);
-		free(sa.body);
-		term_init(1);
-		if (!sm.body)
-			help_window(help_missing, NULL, 0);
-		else
-			help_window(help_corrupt, NULL, 0);
-		endwin();
-		return 0;
-	}
-	prepare_merge(ch);
-	term_init(!selftest);
+	} else
+		term_init(!selftest);
+	use_merge();
 
 	row = 1;
 	find_line(1);
@@ -1788,9 +2105,12 @@ static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 			move(row, curs.col-start+1);
 		switch (selftest) {
 		case 0:
-			c = getch(); break;
+			c = selftest_getch(); break;
 		case 1:
-			c = 'n'; break;
+			c = 'n';
+			if (selftest_keys && *selftest_keys)
+				c = selftest_getch();
+			break;
 		case 2:
 			c = 'q'; break;
 		}
@@ -1873,11 +2193,7 @@ static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 					   p->outfile ? p->outfile : p->file,
 					   backup && (p->outfile ? 0 : !p->is_merge));
 			}
-			if (!just_diff)
-				free(sm.body);
-			free(sb.body);
-			free(sa.body);
-			free_stuff();
+			release_merge(answer);
 			endwin();
 			return answer;
 
@@ -1888,10 +2204,31 @@ static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 				if (answer <= 0)
 					break;
 				changes = 0;
+				merge_revert(ms);
 			}
-			free_stuff();
 			ignore_blanks = ignore_blanks ? 0 : IgnoreBlanks;
-			prepare_merge(ch);
+			old = ms;
+			ms = NULL;
+			if (!nocache)
+				ms = cache_take(p, f, ignore_blanks, just_diff);
+			if (!ms)
+				ms = remerge(old, ignore_blanks);
+			if (progress_abort) {
+				/* Given up on: stay with what we had */
+				progress_abort = 0;
+				merge_free(ms);
+				ms = old;
+				ignore_blanks = ms->ignore_blanks;
+				mesg = "Merge abandoned";
+				refresh = 2;
+				break;
+			}
+			/* The cache discards the changes */
+			if (nocache)
+				merge_free(old);
+			else
+				cache_put(old);
+			use_merge();
 			find_line(pos.p.lineno);
 
 			refresh = 2;
@@ -1909,7 +2246,6 @@ static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 						pos.p.s,
 						pos.p.o);
 			endwin();
-			free_stuff();
 			do_edit(tempname, lineno);
 			sp = wiggle_load_file(tempname);
 			unlink(tempname);
@@ -1925,8 +2261,25 @@ static int merge_window(struct plist *p, FILE *f, int reverse, int replace,
 				sb.body = memdup(sm.body, sm.len);
 			}
 			free(sp.body);
+			old = ms;
+			ms = run_merge(p, f, sm, sb, sa, 0, 0, just_diff);
+			if (progress_abort) {
+				/* Given up on: the edit is lost */
+				progress_abort = 0;
+				merge_free(ms);
+				ms = old;
+				use_merge();
+				mesg = "Merge abandoned";
+				refresh = 2;
+				break;
+			}
+			if (nocache)
+				merge_free(old);
+			else
+				cache_put(old);
+			nocache = 1;
 			ignore_blanks = 0;
-			prepare_merge(0);
+			use_merge();
 			refresh = 2;
 			changes = 1;
 
@@ -2430,6 +2783,7 @@ static int show_merge(char *origname, FILE *patch, int reverse,
 		      int just_diff, int backup)
 {
 	struct plist p = {0};
+	int ret;
 
 	p.file = origname;
 	p.outfile = replace ? outfile : NULL;
@@ -2445,62 +2799,41 @@ static int show_merge(char *origname, FILE *patch, int reverse,
 	p.after = after;
 
 	freopen("/dev/null","w",stderr);
-	return merge_window(&p, patch, reverse, replace, selftest,
-			    ignore_blanks, just_diff, backup);
+	ret = merge_window(&p, patch, reverse, replace, selftest,
+			   ignore_blanks, just_diff, backup);
+	cache_forget(NULL);
+	return ret;
 }
 
 static void calc_one(struct plist *pl, FILE *f, int reverse,
 		     int ignore_blanks, int just_diff)
 {
-	struct stream s1, s2;
-	struct stream s = wiggle_load_segment(f, pl->start, pl->end);
-	struct stream sf;
-	if (pl->is_merge) {
-		if (reverse)
-			wiggle_split_merge(s, &sf, &s2, &s1);
-		else
-			wiggle_split_merge(s, &sf, &s1, &s2);
-		pl->chunks = 0;
-	} else {
-		if (reverse)
-			pl->chunks = wiggle_split_patch(s, &s2, &s1);
-		else
-			pl->chunks = wiggle_split_patch(s, &s1, &s2);
-		if (just_diff)
-			sf = s1;
-		else
-			sf = wiggle_load_file(pl->file);
+	struct merge_state *ms;
+	struct stream sm, sb, sa;
+
+	ms = cache_take(pl, f, ignore_blanks, just_diff);
+	if (!ms) {
+		pl->chunks = load_streams(pl, f, reverse, just_diff,
+					  &sm, &sb, &sa);
+		if (pl->chunks < 0) {
+			pl->chunks = 0;
+			pl->wiggles = pl->conflicts = -1;
+			pl->calced = 1;
+			return;
+		}
+		ms = run_merge(pl, f, sm, sb, sa, pl->chunks,
+			       ignore_blanks, just_diff);
 	}
-	if (sf.body == NULL || s1.body == NULL || s1.body == NULL) {
+	pl->chunks = ms->ch;
+	pl->wiggles = ms->ci.wiggles;
+	pl->conflicts = ms->ci.conflicts;
+	if (progress_abort) {
+		/* Given up on, so the counts are not known */
+		progress_abort = 0;
 		pl->wiggles = pl->conflicts = -1;
-	} else {
-		struct file ff, fp1, fp2;
-		struct csl *csl1, *csl2;
-		struct ci ci;
-		ff = wiggle_split_stream(sf, ByWord | ignore_blanks);
-		fp1 = wiggle_split_stream(s1, ByWord | ignore_blanks);
-		fp2 = wiggle_split_stream(s2, ByWord | ignore_blanks);
-		if (pl->chunks && !just_diff)
-			csl1 = wiggle_pdiff(ff, fp1, pl->chunks);
-		else
-			csl1 = wiggle_diff(ff, fp1, 1);
-		csl2 = wiggle_diff_patch(fp1, fp2, 1);
-		ci = wiggle_make_merger(ff, fp1, fp2, csl1, csl2, 0, 1, 0);
-		pl->wiggles = ci.wiggles;
-		pl->conflicts = ci.conflicts;
-		free(ci.merger);
-		free(csl1);
-		free(csl2);
-		free(ff.list);
-		free(fp1.list);
-		free(fp2.list);
-	}
-
-	free(s1.body);
-	free(s2.body);
-	free(s.body);
-	if (!just_diff)
-		free(sf.body);
+		merge_free(ms);
+	} else
+		cache_put(ms);
 	pl->calced = 1;
 }
 
@@ -2620,26 +2953,23 @@ static void draw_one(int row, struct plist *pl, FILE *f, int reverse,
 static int save_one(FILE *f, struct plist *pl, int reverse,
 		    int ignore_blanks, int backup)
 {
-	struct stream sp, sa, sb, sm;
-	struct file fa, fb, fm;
-	struct csl *csl1, *csl2;
-	struct ci ci;
-	int chunks;
-	sp = wiggle_load_segment(f, pl->start,
-				 pl->end);
-	if (reverse)
-		chunks = wiggle_split_patch(sp, &sa, &sb);
-	else
-		chunks = wiggle_split_patch(sp, &sb, &sa);
-	fb = wiggle_split_stream(sb, ByWord | ignore_blanks);
-	fa = wiggle_split_stream(sa, ByWord | ignore_blanks);
-	sm = wiggle_load_file(pl->file);
-	fm = wiggle_split_stream(sm, ByWord | ignore_blanks);
-	csl1 = wiggle_pdiff(fm, fb, chunks);
-	csl2 = wiggle_diff_patch(fb, fa, 1);
-	ci = wiggle_make_merger(fm, fb, fa, csl1, csl2, 0, 1, 0);
-	return save_merge(fm, fb, fa, ci.merger,
-			  pl->file, backup);
+	struct merge_state *ms;
+	struct stream sm, sb, sa;
+	int ch, ret;
+
+	ms = cache_take(pl, f, ignore_blanks, 0);
+	if (!ms) {
+		ch = load_streams(pl, f, reverse, 0, &sm, &sb, &sa);
+		if (ch < 0)
+			return -1;
+		ms = run_merge(pl, f, sm, sb, sa, ch, ignore_blanks, 0);
+	}
+	ret = save_merge(ms->fm, ms->fb, ms->fa, ms->ci.merger,
+			 pl->file, backup);
+	merge_free(ms);
+	/* The file has changed, so any other merge of it is stale */
+	cache_forget(pl);
+	return ret;
 }
 
 static char *main_help[] = {
@@ -2814,7 +3144,7 @@ static void main_window(struct plist *pl, int np, FILE *f, int reverse,
 			mvaddstr(0, cols - last_mesg_len, bb);
 		}
 		move(row, 9);
-		c = getch();
+		c = selftest_getch();
 		switch (c) {
 		case 'j':
 		case 'n':
@@ -2909,6 +3239,7 @@ static void main_window(struct plist *pl, int np, FILE *f, int reverse,
 				else if (pl[i].end)
 					any++;
 			if (!cnt) {
+				cache_forget(NULL);
 				endwin();
 				return;
 			}
@@ -2933,6 +3264,7 @@ static void main_window(struct plist *pl, int np, FILE *f, int reverse,
 				}
 			} else
 				cnt = 0;
+			cache_forget(NULL);
 			endwin();
 			if (cnt)
 				printf("%d file%s saved\n", cnt,
@@ -2993,6 +3325,7 @@ static void main_window(struct plist *pl, int np, FILE *f, int reverse,
 					mesg = "File has been restored.";
 					pl[pos].is_merge = 0;
 					refresh = 1;
+					cache_forget(&pl[pos]);
 					calc_one(&pl[pos], f, reverse, ignore_blanks, just_diff);
 				} else
 					mesg = "Could not restore file!";
@@ -3128,13 +3461,26 @@ int vpatch(int argc, char *argv[], int patch, int strip,
 	int num_patches;
 	int just_diff = (patch == 2);
 
+	/* selftest feeds keystrokes which must not be taken for these */
+	if (!selftest)
+		wiggle_progress_hook = show_progress;
+	else
+		selftest_keys = getenv("WIGGLE_SELFTEST_KEYS");
+
 	switch (argc) {
 	default:
 		fprintf(stderr, "%s: too many file names given.\n", wiggle_Cmd);
 		exit(1);
 
 	case 0: /* stdin is a patch or diff */
-		if (lseek(fileno(stdin), 0L, 1) == -1) {
+		f = wiggle_fopen("-");
+		if (!f)
+			exit(2);
+		if (f != stdin) {
+			/* decompressed into memory */
+			pl = wiggle_parse_patch(f, NULL, &num_patches);
+			in = f;
+		} else if (lseek(fileno(stdin), 0L, 1) == -1) {
 			/* cannot seek, so need to copy to a temp file */
 			f = tmpfile();
 			if (!f) {
@@ -3162,12 +3508,11 @@ int vpatch(int argc, char *argv[], int patch, int strip,
 		break;
 
 	case 1: /* a patch/diff, a .rej, or a merge file */
-		f = fopen(argv[0], "r");
+		f = wiggle_fopen(argv[0]);
 		if (!f) {
 			fprintf(stderr, "%s: cannot open %s\n", wiggle_Cmd, argv[0]);
 			exit(1);
 		}
-		wiggle_check_dir(argv[0], fileno(f));
 		if (patch) {
 			pl = wiggle_parse_patch(f, NULL, &num_patches);
 			if (!just_diff && wiggle_set_prefix(pl, num_patches, strip) == 0) {
@@ -3198,12 +3543,11 @@ int vpatch(int argc, char *argv[], int patch, int strip,
 				   selftest, ignore_blanks, just_diff, backup);
 			break;
 		}
-		f = fopen(argv[1], "r");
+		f = wiggle_fopen(argv[1]);
 		if (!f) {
 			fprintf(stderr, "%s: cannot open %s\n", wiggle_Cmd, argv[0]);
 			exit(1);
 		}
-		wiggle_check_dir(argv[1], fileno(f));
 		show_merge(argv[0], f, reverse, 0, NULL, NULL,
 			   replace, outfilename,
 			   selftest, ignore_blanks, just_diff, backup);
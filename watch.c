@@ -0,0 +1,614 @@
+/*
+ * wiggle - apply rejected patches
+ *
+ * Copyright (C) 2003 Neil Brown <neilb@cse.unsw.edu.au>
+ * Copyright (C) 2010-2013 Neil Brown <neilb@suse.de>
+ * Copyright (C) 2014-2020 Neil Brown <neil@brown.name>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.
+ *
+ *    Author: Neil Brown
+ *    Email: <neil@brown.name>
+ */
+
+/*
+ * Merge again whenever one of the files changes.
+ *
+ * While a conflict is being resolved by hand, the same merge is run
+ * after every save.  Most of that work is repeated: the file usually
+ * differs from last time in a few lines, but is split into words and
+ * diffed in full.
+ *
+ * Here the words and the alignments are kept between merges.  When a
+ * file changes, only the text between the first and last changed byte
+ * is split again, and the words either side are kept (moved to the new
+ * text).  Each alignment involving that file keeps its matches outside
+ * the changed words, and the gap between them is diffed again on its
+ * own.  Only the merge itself, which is linear, is redone from scratch.
+ *
+ * Changes are noticed with inotify on the directory holding each file,
+ * so that editors which save by renaming a new file into place are
+ * seen too.
+ */
+
+#include	"wiggle.h"
+#include	<errno.h>
+#include	<unistd.h>
+#include	<stdlib.h>
+#include	<poll.h>
+#include	<sys/time.h>
+#include	<sys/inotify.h>
+
+/* Once a change is seen, wait until there have been none for this
+ * many milliseconds before merging, so a save which writes several
+ * files, or writes one more than once, causes only one merge.
+ */
+#define SETTLE_MS 20
+
+/* Load the files named in argv and find the three streams to merge,
+ * as do_merge() does.  Returns 0, having said why, if they cannot be
+ * loaded.
+ */
+static int load_streams(int argc, char *argv[], int reverse,
+			struct stream s[3], int *chunks)
+{
+	struct stream f;
+	int i, ok = 1;
+
+	for (i = 0; i < 3; i++)
+		s[i].body = NULL;
+	for (i = 0; i < argc; i++) {
+		s[i] = wiggle_load_file(argv[i]);
+		if (s[i].body == NULL) {
+			fprintf(stderr, "%s: cannot load file '%s' - %s\n",
+				wiggle_Cmd, argv[i], strerror(errno));
+			ok = 0;
+			break;
+		}
+	}
+	*chunks = 0;
+	if (ok && argc == 1) {
+		f = s[0];
+		ok = wiggle_split_merge(f, &s[0], &s[1], &s[2]);
+		free(f.body);
+		if (!ok)
+			fprintf(stderr, "%s: merge file %s looks bad.\n",
+				wiggle_Cmd, argv[0]);
+	} else if (ok && argc == 2) {
+		f = s[1];
+		*chunks = wiggle_split_patch(f, &s[1], &s[2]);
+		free(f.body);
+	}
+	for (i = 0; ok && i < 3; i++)
+		if (s[i].body == NULL) {
+			fprintf(stderr, "%s: file %d missing\n", wiggle_Cmd, i);
+			ok = 0;
+		}
+	if (!ok) {
+		for (i = 0; i < 3; i++)
+			free(s[i].body);
+		return 0;
+	}
+	if (reverse) {
+		f = s[1];
+		s[1] = s[2];
+		s[2] = f;
+	}
+	return 1;
+}
+
+/* Can splitting start afresh at 'e' and find the same words as
+ * splitting the whole of 's'?  It can at the start of a line, unless
+ * blank lines before it were folded into the word.
+ */
+static int sync_point(struct stream s, struct elmnt *e)
+{
+	return e->prefix == 0 &&
+		(e->start == s.body || e->start[-1] == '\n');
+}
+
+/* The number of bytes that are the same at the start of 'a' and 'b' */
+static int common_head(char *a, char *b, int len)
+{
+	int n = 0;
+
+	while (n + 4096 <= len && memcmp(a + n, b + n, 4096) == 0)
+		n += 4096;
+	while (n < len && a[n] == b[n])
+		n++;
+	return n;
+}
+
+/* The number of bytes that are the same before 'a' and 'b' */
+static int common_tail(char *a, char *b, int len)
+{
+	int n = 0;
+
+	while (n + 4096 <= len &&
+	       memcmp(a - n - 4096, b - n - 4096, 4096) == 0)
+		n += 4096;
+	while (n < len && a[-1 - n] == b[-1 - n])
+		n++;
+	return n;
+}
+
+/* The first word of 's' that starts at or after 'offset' */
+static int word_at(struct stream s, struct file *f, int offset)
+{
+	int lo = 0, hi = f->elcnt;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (f->list[mid].start - s.body < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* 'f' holds the words of 'old', which 'new' has replaced.  Change it
+ * to hold the words of 'new', splitting again only the text between
+ * the first and last bytes that differ.  Words [*lo, *ohi) of 'old'
+ * become words [*lo, *nhi) of 'new', and those either side are the
+ * same words moved to the new text.  Returns 0, leaving 'f' as it is,
+ * if the text is the same.
+ */
+static int resplit(struct stream old, struct stream new, struct file *f,
+		   int type, int *lo, int *ohi, int *nhi)
+{
+	int head, tail, shortest;
+	int first, last, k, cnt;
+	int start, end;
+	struct stream mid;
+	struct file m = {NULL, 0};
+
+	shortest = old.len < new.len ? old.len : new.len;
+	head = common_head(old.body, new.body, shortest);
+	if (head == old.len && head == new.len)
+		return 0;
+	tail = common_tail(old.body + old.len, new.body + new.len,
+			   shortest - head);
+
+	/* Start at the last place splitting can restart before the
+	 * first difference, and end at the first after the last.
+	 * The character before the end must be unchanged too.
+	 */
+	for (first = word_at(old, f, head) - 1;
+	     first > 0 && !sync_point(old, &f->list[first]); first--)
+		;
+	if (first < 0)
+		first = 0;
+	last = word_at(old, f, old.len - tail + 1);
+	if (last <= first)
+		last = first + 1;
+	while (last < f->elcnt && !sync_point(old, &f->list[last]))
+		last++;
+	if (last > f->elcnt)
+		last = f->elcnt;
+	start = first ? f->list[first].start - old.body : 0;
+	end = last < f->elcnt ? f->list[last].start - old.body : old.len;
+
+	mid.body = new.body + start;
+	mid.len = new.len - (old.len - end) - start;
+	if (mid.len > 0)
+		m = wiggle_split_stream(mid, type);
+
+	/* Rearrange the list in place: it can be large, and most of it
+	 * stays where it is.
+	 */
+	cnt = first + m.elcnt + f->elcnt - last;
+	if (cnt > f->elcnt) {
+		f->list = realloc(f->list, cnt * sizeof(*f->list));
+		if (!f->list)
+			wiggle_die("realloc");
+	}
+	memmove(f->list + first + m.elcnt, f->list + last,
+		(f->elcnt - last) * sizeof(*f->list));
+	if (m.elcnt)
+		memcpy(f->list + first, m.list, m.elcnt * sizeof(*f->list));
+	free(m.list);
+	for (k = 0; k < first; k++)
+		f->list[k].start = new.body + (f->list[k].start - old.body);
+	for (k = first + m.elcnt; k < cnt; k++)
+		f->list[k].start = new.body + new.len -
+			(old.body + old.len - f->list[k].start);
+	f->elcnt = cnt;
+	*lo = first;
+	*ohi = last;
+	*nhi = first + m.elcnt;
+	return 1;
+}
+
+static void csl_swap(struct csl *c)
+{
+	for (;; c++) {
+		int t = c->a;
+
+		c->a = c->b;
+		c->b = t;
+		if (!c->len)
+			break;
+	}
+}
+
+/* 'csl' matches 'a' to 'b', but words [lo, ohi) of 'a' have since
+ * been replaced by [lo, nhi).  Keep the matches that don't touch
+ * those words, diff the gap between them again, and return the new
+ * list.  If the gap is most of the files, return NULL as a full diff
+ * will do better for the same effort.
+ * If 'placed', 'b' is a patch whose hunks were placed in 'a' by
+ * wiggle_pdiff().  Moving a hunk needs that again, so return NULL
+ * unless the gap holds no words of 'b'.
+ */
+static struct csl *csl_splice(struct csl *csl, struct file a, struct file b,
+			      int lo, int ohi, int nhi, int flags, int placed)
+{
+	int n, first, last, i, cnt = 0;
+	int alo = 0, blo = 0, ahi, bhi;
+	struct csl *gap = NULL, *new;
+	struct file ga, gb;
+	int delta = nhi - ohi;
+
+	for (n = 0; csl[n].len; n++)
+		;
+	/* csl[first] is the first match reaching 'lo', and
+	 * csl[last] the first starting at or after 'ohi'.
+	 */
+	for (first = 0; first < n && csl[first].a + csl[first].len <= lo;
+	     first++)
+		;
+	for (last = n; last > first && csl[last-1].a >= ohi; last--)
+		;
+
+	new = wiggle_xmalloc((n + 3) * sizeof(*new));
+	for (i = 0; i < first; i++)
+		new[cnt++] = csl[i];
+	if (first < last && csl[first].a < lo) {
+		new[cnt] = csl[first];
+		new[cnt++].len = lo - csl[first].a;
+	}
+	if (cnt) {
+		alo = new[cnt-1].a + new[cnt-1].len;
+		blo = new[cnt-1].b + new[cnt-1].len;
+	}
+	ahi = csl[last].a + delta;
+	bhi = csl[last].b;
+	if (first < last && csl[last-1].a + csl[last-1].len > ohi) {
+		int skip = ohi - csl[last-1].a;
+
+		ahi = nhi;
+		bhi = csl[last-1].b + skip;
+	}
+	if ((placed && bhi > blo) ||
+	    (ahi - alo + bhi - blo > 1000 &&
+	     2 * (ahi - alo + bhi - blo) > a.elcnt + b.elcnt)) {
+		free(new);
+		return NULL;
+	}
+
+	i = 0;
+	if (ahi > alo && bhi > blo) {
+		ga.list = a.list + alo;
+		ga.elcnt = ahi - alo;
+		gb.list = b.list + blo;
+		gb.elcnt = bhi - blo;
+		gap = wiggle_diff(ga, gb, flags);
+		for (i = 0; gap[i].len; i++)
+			;
+	}
+	new = realloc(new, (n + i + 3) * sizeof(*new));
+	if (!new)
+		wiggle_die("realloc");
+	for (i = 0; gap && gap[i].len; i++) {
+		new[cnt].a = gap[i].a + alo;
+		new[cnt].b = gap[i].b + blo;
+		new[cnt++].len = gap[i].len;
+	}
+	free(gap);
+	if (first < last && csl[last-1].a + csl[last-1].len > ohi) {
+		int skip = ohi - csl[last-1].a;
+
+		new[cnt].a = nhi;
+		new[cnt].b = csl[last-1].b + skip;
+		new[cnt++].len = csl[last-1].len - skip;
+	}
+	for (i = last; i <= n; i++) {
+		new[cnt] = csl[i];
+		new[cnt++].a += delta;
+	}
+
+	/* Join matches which now meet */
+	for (i = 1, n = 1; i < cnt; i++) {
+		struct csl *p = &new[n-1];
+
+		if (new[i].len && p->a + p->len == new[i].a &&
+		    p->b + p->len == new[i].b)
+			p->len += new[i].len;
+		else
+			new[n++] = new[i];
+	}
+	return new;
+}
+
+/* As csl_splice(), but for a change in 'b' */
+static struct csl *csl_splice_b(struct csl *csl, struct file a, struct file b,
+				int lo, int ohi, int nhi, int flags)
+{
+	struct csl *new;
+
+	csl_swap(csl);
+	new = csl_splice(csl, b, a, lo, ohi, nhi, flags, 0);
+	csl_swap(csl);
+	if (new)
+		csl_swap(new);
+	return new;
+}
+
+struct watch {
+	struct stream s[3];
+	struct file fl[3];
+	struct csl *csl1, *csl2;
+	int chunks;
+	int type, diff_flags;
+};
+
+static void rediff(struct watch *w, int changed[3], int lo[3],
+		   int ohi[3], int nhi[3])
+{
+	struct csl *csl = NULL;
+
+	if (changed[0] || changed[1]) {
+		if (w->csl1 && !changed[1])
+			csl = csl_splice(w->csl1, w->fl[0], w->fl[1],
+					 lo[0], ohi[0], nhi[0], w->diff_flags,
+					 w->chunks);
+		else if (w->csl1 && !changed[0] && !w->chunks)
+			csl = csl_splice_b(w->csl1, w->fl[0], w->fl[1],
+					   lo[1], ohi[1], nhi[1],
+					   w->diff_flags);
+		if (!csl && w->chunks)
+			csl = wiggle_pdiff(w->fl[0], w->fl[1], w->chunks);
+		else if (!csl)
+			csl = wiggle_diff(w->fl[0], w->fl[1], w->diff_flags);
+		free(w->csl1);
+		w->csl1 = csl;
+	}
+	csl = NULL;
+	if (changed[1] || changed[2]) {
+		/* Hunk headers in a patch must stay lined up, which
+		 * only wiggle_diff_patch() promises.
+		 */
+		if (w->csl2 && !w->chunks && !changed[2])
+			csl = csl_splice(w->csl2, w->fl[1], w->fl[2],
+					 lo[1], ohi[1], nhi[1], w->diff_flags,
+					 0);
+		else if (w->csl2 && !w->chunks && !changed[1])
+			csl = csl_splice_b(w->csl2, w->fl[1], w->fl[2],
+					   lo[2], ohi[2], nhi[2],
+					   w->diff_flags);
+		if (!csl)
+			csl = wiggle_diff_patch(w->fl[1], w->fl[2],
+						w->diff_flags);
+		free(w->csl2);
+		w->csl2 = csl;
+	}
+}
+
+static void remerge(struct watch *w, char *outfilename, int words,
+		    int ignore, int show_wiggles, int quiet, int check,
+		    struct timeval *start)
+{
+	struct timeval stop;
+	struct replace rp;
+	struct ci ci;
+	FILE *out;
+
+	if (check)
+		ci = wiggle_check_merger(w->fl[0], w->fl[1], w->fl[2],
+					 w->csl1, w->csl2, words, ignore,
+					 show_wiggles > 1, 0);
+	else {
+		ci = wiggle_make_merger(w->fl[0], w->fl[1], w->fl[2],
+					w->csl1, w->csl2, words, ignore,
+					show_wiggles > 1);
+		/* Whatever reads the output must never see it half written */
+		out = wiggle_replace_open(&rp, outfilename, 0, 0);
+		if (!out)
+			fprintf(stderr, "%s: could not create temporary file for %s - %s\n",
+				wiggle_Cmd, outfilename, strerror(errno));
+		else {
+			wiggle_print_merge(out, &w->fl[0], &w->fl[1],
+					   &w->fl[2], words, ci.merger,
+					   NULL, 0, 0);
+			if (wiggle_replace_commit(&rp) != 0)
+				fprintf(stderr, "%s: failed to %s. - %s\n",
+					wiggle_Cmd, rp.failed,
+					strerror(errno));
+		}
+	}
+	free(ci.merger);
+	if (!quiet)
+		fprintf(stderr, "%d unresolved conflict%s found\n",
+			ci.conflicts, ci.conflicts == 1 ? "" : "s");
+	if (!quiet && ci.ignored)
+		fprintf(stderr, "%d already-applied change%s ignored\n",
+			ci.ignored, ci.ignored == 1 ? "" : "s");
+	if (wiggle_do_trace) {
+		gettimeofday(&stop, NULL);
+		fprintf(stderr, "%s: merge took %ldms\n", wiggle_Cmd,
+			(stop.tv_sec - start->tv_sec) * 1000 +
+			(stop.tv_usec - start->tv_usec) / 1000);
+	}
+}
+
+/* Watch the directory holding each file named in argv.
+ * names[i] is the last component of argv[i] and wd[i] the watch
+ * it is reported under.
+ */
+static int watch_files(int argc, char *argv[], char *names[3], int wd[3])
+{
+	int fd, i;
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: cannot watch files - %s\n",
+			wiggle_Cmd, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < argc; i++) {
+		char *slash = strrchr(argv[i], '/');
+		char *dir;
+
+		if (slash) {
+			dir = strndup(argv[i], slash - argv[i] + 1);
+			names[i] = slash + 1;
+		} else {
+			dir = strdup(".");
+			names[i] = argv[i];
+		}
+		wd[i] = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd[i] < 0)
+			fprintf(stderr, "%s: cannot watch %s - %s\n",
+				wiggle_Cmd, dir, strerror(errno));
+		free(dir);
+		if (wd[i] < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/* Wait until one of the files has been written and things have
+ * settled.  Returns 0 if watching failed.
+ */
+static int wait_change(int fd, int argc, char *names[3], int wd[3])
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int seen = 0;
+
+	while (!seen || poll(&pfd, 1, SETTLE_MS) > 0) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		char *p;
+
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: lost watch on files - %s\n",
+				wiggle_Cmd, len ? strerror(errno) : "EOF");
+			return 0;
+		}
+		for (p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (void *)p;
+			int i;
+
+			for (i = 0; i < argc; i++)
+				if (ev->wd == wd[i] && ev->len &&
+				    strcmp(ev->name, names[i]) == 0)
+					seen = 1;
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+	return 1;
+}
+
+/* Merge the files in argv as do_merge() does, with the result written
+ * to 'outfilename' or, with 'check', just the conflicts counted.  Then
+ * merge again each time one of the files is changed, until killed.
+ */
+int wiggle_watch(int argc, char *argv[], int obj, int blanks,
+		 int reverse, int ignore, int show_wiggles,
+		 char *outfilename, int quiet, int diff_flags, int check)
+{
+	struct watch w = {};
+	struct stream s[3];
+	struct timeval start;
+	char *names[3];
+	int wd[3];
+	int fd, i;
+
+	if (argc < 1 || argc > 3) {
+		fprintf(stderr, "%s: --watch needs one to three files\n",
+			wiggle_Cmd);
+		return 2;
+	}
+	fd = watch_files(argc, argv, names, wd);
+	if (fd < 0)
+		return 2;
+	wiggle_trace_name = argv[0];
+	if (!load_streams(argc, argv, reverse, w.s, &w.chunks))
+		return 2;
+
+	/* The kind of words must stay the same from one merge to the
+	 * next, so they are planned once for the first files seen.
+	 */
+	w.type = blanks | (obj == 'l' ? ByLine : ByWord);
+	w.diff_flags = diff_flags;
+	wiggle_plan(w.s, &w.type, &w.diff_flags, w.chunks);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 3; i++)
+		w.fl[i] = wiggle_split_stream(w.s[i], w.type);
+	if (w.chunks)
+		w.csl1 = wiggle_pdiff(w.fl[0], w.fl[1], w.chunks);
+	else
+		w.csl1 = wiggle_diff(w.fl[0], w.fl[1], w.diff_flags);
+	w.csl2 = wiggle_diff_patch(w.fl[1], w.fl[2], w.diff_flags);
+	remerge(&w, outfilename, obj == 'w', ignore, show_wiggles, quiet,
+		check, &start);
+
+	while (wait_change(fd, argc, names, wd)) {
+		int changed[3], lo[3], ohi[3], nhi[3];
+		int chunks;
+
+		if (!load_streams(argc, argv, reverse, s, &chunks))
+			/* Probably part way through being saved */
+			continue;
+		gettimeofday(&start, NULL);
+		for (i = 0; i < 3; i++) {
+			changed[i] = resplit(w.s[i], s[i], &w.fl[i], w.type,
+					     &lo[i], &ohi[i], &nhi[i]);
+			if (changed[i]) {
+				free(w.s[i].body);
+				w.s[i] = s[i];
+			} else
+				free(s[i].body);
+		}
+		if (chunks != w.chunks) {
+			/* Hunks were added or removed: start again */
+			w.chunks = chunks;
+			free(w.csl1);
+			free(w.csl2);
+			w.csl1 = w.csl2 = NULL;
+			changed[0] = changed[1] = changed[2] = 1;
+		}
+		if (!changed[0] && !changed[1] && !changed[2])
+			continue;
+		rediff(&w, changed, lo, ohi, nhi);
+		remerge(&w, outfilename, obj == 'w', ignore, show_wiggles,
+			quiet, check, &start);
+	}
+	close(fd);
+	for (i = 0; i < 3; i++) {
+		free(w.s[i].body);
+		free(w.fl[i].list);
+	}
+	free(w.csl1);
+	free(w.csl2);
+	return 2;
+}
@@ -90,6 +90,8 @@
 #include	<stdio.h>
 #include	<ctype.h>
 #include	<sys/stat.h>
+#include	<sys/time.h>
+#include	<limits.h>
 
 static void printsep(struct elmnt e1, struct elmnt e2)
 {
@@ -102,9 +104,12 @@ static void printsep(struct elmnt e1, struct elmnt e2)
 static int extract(int argc, char *argv[], int ispatch, int which)
 {
 	/* extract a branch of a diff or diff3 or merge output
-	 * We need one file
+	 * We need one file.  It is processed a line at a time so
+	 * even a huge file needs very little memory.
 	 */
-	struct stream f, flist[3];
+	FILE *f;
+	long limit;
+	int rv;
 
 	if (argc == 0) {
 		fprintf(stderr,
@@ -116,48 +121,66 @@ static int extract(int argc, char *argv[], int ispatch, int which)
 			"%s: only give one file for --extract\n", wiggle_Cmd);
 		return 2;
 	}
-	f = wiggle_load_file(argv[0]);
-	if (f.body == NULL) {
+	if (ispatch && which == '3') {
+		fprintf(stderr,
+			"%s: %s has no -%c component.\n", wiggle_Cmd,
+			argv[0], which);
+		return 2;
+	}
+	f = wiggle_open_file(argv[0], &limit);
+	if (f == NULL) {
 		fprintf(stderr,
 			"%s: cannot load file '%s' - %s\n", wiggle_Cmd,
 			argv[0], strerror(errno));
 		return 2;
 	}
-	if (ispatch) {
-		if (wiggle_split_patch(f, &flist[0], &flist[1]) == 0) {
-			fprintf(stderr,
-				"%s: No chunk found in patch: %s\n", wiggle_Cmd,
-				argv[0]);
-			return 0;
-		}
-	} else {
-		if (!wiggle_split_merge(f, &flist[0], &flist[1], &flist[2])) {
-			fprintf(stderr,
-				"%s: merge file %s looks bad.\n", wiggle_Cmd,
-				argv[0]);
-			return 2;
-		}
+	rv = wiggle_extract(f, limit, stdout, ispatch, which - '0');
+	if (f != stdin)
+		fclose(f);
+	if (fflush(stdout) != 0)
+		return 2;
+	/* The output so far has gone, so the exit status must say
+	 * not to trust it.
+	 */
+	if (ispatch && rv < 0) {
+		fprintf(stderr,
+			"%s: patch %s is malformed, output is incomplete.\n",
+			wiggle_Cmd, argv[0]);
+		return 2;
 	}
-	if (flist[which-'1'].body == NULL) {
+	if (ispatch && rv == 0) {
 		fprintf(stderr,
-			"%s: %s has no -%c component.\n", wiggle_Cmd,
-			argv[0], which);
+			"%s: No chunk found in patch: %s\n", wiggle_Cmd,
+			argv[0]);
+		return 0;
+	}
+	if (!ispatch && !rv) {
+		fprintf(stderr,
+			"%s: merge file %s looks bad, output is incomplete.\n",
+			wiggle_Cmd, argv[0]);
 		return 2;
-	} else {
-		if (write(1, flist[which-'1'].body,
-			  flist[which-'1'].len)
-		    != flist[which-'1'].len)
-			return 2;
 	}
 	return 0;
 }
 
-static int do_diff_lines(struct file fl[2], struct csl *csl)
-{
+/* Diff output is produced one common run at a time, so that
+ * wiggle_diff_stream() can hand us each run as soon as it is found.
+ */
+struct diff_out {
+	struct file *fl;
 	int a, b;
-	int exit_status = 0;
-	a = b = 0;
-	while (a < fl[0].elcnt || b < fl[1].elcnt) {
+	int sol; /* start of line */
+	int exit_status;
+};
+
+/* Print everything up to the end of the common run 'csl' */
+static void diff_lines_csl(void *data, struct csl *csl)
+{
+	struct diff_out *d = data;
+	struct file *fl = d->fl;
+	int a = d->a, b = d->b;
+
+	while (a < csl->a + csl->len || b < csl->b + csl->len) {
 		if (a < csl->a) {
 			if (fl[0].list[a].start[0]) {
 				printf("-");
@@ -165,7 +188,7 @@ static int do_diff_lines(struct file fl[2], struct csl *csl)
 						 fl[0].list[a]);
 			}
 			a++;
-			exit_status = 1;
+			d->exit_status = 1;
 		} else if (b < csl->b) {
 			if (fl[1].list[b].start[0]) {
 				printf("+");
@@ -173,7 +196,7 @@ static int do_diff_lines(struct file fl[2], struct csl *csl)
 						 fl[1].list[b]);
 			}
 			b++;
-			exit_status = 1;
+			d->exit_status = 1;
 		} else {
 			if (fl[0].list[a].start[0] == '\0')
 				printsep(fl[0].list[a],
@@ -185,22 +208,22 @@ static int do_diff_lines(struct file fl[2], struct csl *csl)
 			}
 			a++;
 			b++;
-			if (a >= csl->a+csl->len)
-				csl++;
 		}
 	}
-	return exit_status;
+	d->a = a;
+	d->b = b;
 }
 
-static int do_diff_words(struct file fl[2], struct csl *csl)
+static void diff_words_csl(void *data, struct csl *csl)
 {
-	int a, b;
-	int exit_status = 0;
-	int sol = 1; /* start of line */
-	a = b = 0;
-	while (a < fl[0].elcnt || b < fl[1].elcnt) {
+	struct diff_out *d = data;
+	struct file *fl = d->fl;
+	int a = d->a, b = d->b;
+	int sol = d->sol;
+
+	while (a < csl->a + csl->len || b < csl->b + csl->len) {
 		if (a < csl->a) {
-			exit_status = 1;
+			d->exit_status = 1;
 			if (sol) {
 				int a1;
 				/* If we remove a
@@ -238,7 +261,7 @@ static int do_diff_words(struct file fl[2], struct csl *csl)
 				sol = 0;
 			}
 		} else if (b < csl->b) {
-			exit_status = 1;
+			d->exit_status = 1;
 			if (sol) {
 				int b1;
 				sol = 0;
@@ -302,15 +325,49 @@ static int do_diff_words(struct file fl[2], struct csl *csl)
 				a++;
 				b++;
 			}
-			if (a >= csl->a+csl->len)
-				csl++;
 		}
 	}
-	return exit_status;
+	d->a = a;
+	d->b = b;
+	d->sol = sol;
+}
+
+static int do_diff_lines(struct file fl[2], struct csl *csl)
+{
+	struct diff_out d = { fl, 0, 0, 1, 0 };
+
+	do
+		diff_lines_csl(&d, csl);
+	while ((csl++)->len);
+	return d.exit_status;
+}
+
+static int do_diff_words(struct file fl[2], struct csl *csl)
+{
+	struct diff_out d = { fl, 0, 0, 1, 0 };
+
+	do
+		diff_words_csl(&d, csl);
+	while ((csl++)->len);
+	return d.exit_status;
+}
+
+static void print_line_counts(struct file fl[2])
+{
+	/* count lines in each file */
+	int l1, l2, i;
+	l1 = l2 = 0;
+	for (i = 0 ; i < fl[0].elcnt ; i++)
+		if (ends_line(fl[0].list[i]))
+			l1++;
+	for (i = 0 ; i < fl[1].elcnt ; i++)
+		if (ends_line(fl[1].list[i]))
+			l2++;
+	printf("@@ -1,%d +1,%d @@\n", l1, l2);
 }
 
 static int do_diff(int argc, char *argv[], int obj, int ispatch,
-		   int which, int reverse, int shortest)
+		   int which, int reverse, int diff_flags)
 {
 	/* create a diff (line or char) of two streams */
 	struct stream f, flist[3];
@@ -319,6 +376,7 @@ static int do_diff(int argc, char *argv[], int obj, int ispatch,
 	struct file fl[2];
 	struct csl *csl;
 
+	wiggle_trace_name = argc ? argv[0] : NULL;
 	switch (argc) {
 	case 0:
 		fprintf(stderr, "%s: no file given for --diff\n", wiggle_Cmd);
@@ -384,59 +442,152 @@ static int do_diff(int argc, char *argv[], int obj, int ispatch,
 		flist[0] = flist[1];
 		flist[1] = f;
 	}
+	if (!chunks1) {
+		/* A patch is diffed a hunk at a time, which is cheap */
+		struct stream two[3] = { flist[0], flist[1] };
+
+		wiggle_plan(two, &obj, &diff_flags, chunks2);
+	}
 	fl[0] = wiggle_split_stream(flist[0], obj);
 	fl[1] = wiggle_split_stream(flist[1], obj);
-	if (!(obj & WholeWord) && fl[0].elcnt > 50000 && fl[1].elcnt > 50000) {
-		/* Too big - use fewer words if possible */
-		free(fl[0].list);
-		free(fl[1].list);
-		obj |= WholeWord;
-		fl[0] = wiggle_split_stream(flist[0], obj);
-		fl[1] = wiggle_split_stream(flist[1], obj);
+	if (!chunks1 && !chunks2) {
+		/* Two plain files: print the diff as it is found */
+		struct diff_out d = { fl, 0, 0, 1, 0 };
+
+		if ((obj & ByMask) == ByLine) {
+			printf("@@ -1,%d +1,%d @@\n",
+			       fl[0].elcnt, fl[1].elcnt);
+			wiggle_diff_stream(fl[0], fl[1], diff_flags,
+					   diff_lines_csl, &d);
+		} else {
+			print_line_counts(fl);
+			wiggle_diff_stream(fl[0], fl[1], diff_flags,
+					   diff_words_csl, &d);
+		}
+		return d.exit_status;
 	}
 	if (chunks2 && !chunks1)
 		csl = wiggle_pdiff(fl[0], fl[1], chunks2);
 	else
-		csl = wiggle_diff_patch(fl[0], fl[1], shortest);
+		csl = wiggle_diff_patch(fl[0], fl[1], diff_flags);
 	if ((obj & ByMask) == ByLine) {
 		if (!chunks1)
 			printf("@@ -1,%d +1,%d @@\n",
 			       fl[0].elcnt, fl[1].elcnt);
 		exit_status = do_diff_lines(fl, csl);
 	} else {
-		if (!chunks1) {
-			/* count lines in each file */
-			int l1, l2, i;
-			l1 = l2 = 0;
-			for (i = 0 ; i < fl[0].elcnt ; i++)
-				if (ends_line(fl[0].list[i]))
-					l1++;
-			for (i = 0 ; i < fl[1].elcnt ; i++)
-				if (ends_line(fl[1].list[i]))
-					l2++;
-			printf("@@ -1,%d +1,%d @@\n", l1, l2);
-		}
+		if (!chunks1)
+			print_line_counts(fl);
 		exit_status = do_diff_words(fl, csl);
 	}
 	return exit_status;
 }
 
+/* When a merge would need more than wiggle_max_memory, it is done
+ * more coarsely, trying each of these in turn.
+ */
+enum { BudgetOK, BudgetWholeWord, BudgetLine, BudgetWindow, BudgetFail };
+static char *budget_names[] = {
+	[BudgetWholeWord] = "by whole words",
+	[BudgetLine] = "by lines",
+	[BudgetWindow] = "a window at a time",
+};
+/* lines either side of each hunk for a BudgetWindow merge */
+#define BUDGET_WINDOW 1000
+
+static long merge_cost(struct stream flist[3], int blanks)
+{
+	int n0 = wiggle_count_stream(flist[0], blanks);
+	int n1 = wiggle_count_stream(flist[1], blanks);
+	int n2 = wiggle_count_stream(flist[2], blanks);
+
+	return (long)flist[0].len + flist[1].len + flist[2].len +
+		(long)(n0 + n1 + n2) * sizeof(struct elmnt) +
+		wiggle_diff_cost(n0, n1) + wiggle_diff_cost(n1, n2) +
+		wiggle_merge_cost(n0, n1, n2);
+}
+
+/* Choose the finest granularity that fits in wiggle_max_memory,
+ * updating 'blanks' and 'obj' to match.
+ */
+static int budget_merge(struct stream flist[3], int *blanks, int *obj,
+			int can_window)
+{
+	if (merge_cost(flist, *blanks) <= wiggle_max_memory)
+		return BudgetOK;
+	if ((*blanks & ByWord) && !(*blanks & WholeWord)) {
+		*blanks |= WholeWord;
+		if (merge_cost(flist, *blanks) <= wiggle_max_memory)
+			return BudgetWholeWord;
+	}
+	if (*blanks & ByWord) {
+		*blanks = (*blanks & ~(ByWord | WholeWord)) | ByLine;
+		*obj = 'l';
+		if (merge_cost(flist, *blanks) <= wiggle_max_memory)
+			return BudgetLine;
+	}
+	if (can_window)
+		return BudgetWindow;
+	return BudgetFail;
+}
+
+/* 'file' doesn't exist, perhaps because it has been renamed or split
+ * up, so look for every hunk of the patch under --search.
+ */
+static void search_missing(char *file, char *patch, int obj, int blanks,
+			   int reverse, struct bundle *bundle, int bfile)
+{
+	struct stream f, before, after;
+	struct file fl;
+
+	if (bundle)
+		wiggle_bundle_patch(bundle, bfile, &before, &after);
+	else {
+		f = wiggle_load_file(patch);
+		if (!f.body)
+			return;
+		wiggle_split_patch(f, &before, &after);
+		free(f.body);
+	}
+	blanks |= obj == 'l' ? ByLine : ByWord;
+	fl = wiggle_split_stream(reverse ? after : before, blanks);
+	wiggle_relocate(file, fl, NULL, blanks);
+	free(fl.list);
+	if (!bundle) {
+		free(before.body);
+		free(after.body);
+	}
+}
+
 static int do_merge(int argc, char *argv[], int obj, int blanks,
 		    int reverse, int replace, char *outfilename,
 		    int ignore, int show_wiggles,
-		    int quiet, int shortest, int backup)
+		    int quiet, int diff_flags, int backup, int check,
+		    int window, int *conflictsp,
+		    struct bundle *bundle, int bfile)
 {
 	/* merge three files, A B C, so changed between B and C get made to A
+	 * If 'conflictsp' is given, the number of conflicts is stored there.
+	 * If 'bundle' is given, the patch is file 'bfile' in it rather
+	 * than argv[1].
 	 */
 	struct stream f, flist[3];
 	struct file fl[3];
 	int i;
 	int chunks1 = 0, chunks2 = 0, chunks3 = 0;
-	char *replacename = NULL, *orignew = NULL;
-	struct csl *csl1, *csl2;
+	struct replace rp;
+	struct csl *csl1, *csl2 = NULL;
 	struct ci ci;
 	FILE *outfile = stdout;
+	FILE *origfile = NULL;
+	struct timeval start, stop;
 
+	if (window && argc != 2) {
+		fprintf(stderr, "%s: --window needs a file and a patch\n",
+			wiggle_Cmd);
+		return 2;
+	}
+	wiggle_trace_name = argc ? argv[0] : NULL;
 	switch (argc) {
 	case 0:
 		fprintf(stderr, "%s: no files given for --merge\n", wiggle_Cmd);
@@ -445,11 +596,33 @@ static int do_merge(int argc, char *argv[], int obj, int blanks,
 	case 2:
 	case 1:
 		for (i = 0; i < argc; i++) {
+			if (i == 0 && window) {
+				/* Original is read a window at a time */
+				origfile = wiggle_fopen(argv[0]);
+				if (!origfile) {
+					fprintf(stderr, "%s: cannot open file '%s' - %s\n",
+						wiggle_Cmd,
+						argv[0], strerror(errno));
+					return 2;
+				}
+				flist[0].body = NULL;
+				flist[0].len = 0;
+				continue;
+			}
+			if (i == 1 && bundle)
+				continue;
 			flist[i] = wiggle_load_file(argv[i]);
 			if (flist[i].body == NULL) {
+				int err = errno;
+
 				fprintf(stderr, "%s: cannot load file '%s' - %s\n",
 					wiggle_Cmd,
-					argv[i], strerror(errno));
+					argv[i], strerror(err));
+				if (i == 0 && argc == 2 && err == ENOENT &&
+				    wiggle_search_dir)
+					search_missing(argv[0], argv[1], obj,
+						       blanks, reverse,
+						       bundle, bfile);
 				return 2;
 			}
 		}
@@ -470,6 +643,11 @@ static int do_merge(int argc, char *argv[], int obj, int blanks,
 		}
 		break;
 	case 2: /* a file and a patch */
+		if (bundle) {
+			chunks2 = chunks3 = wiggle_bundle_patch(
+				bundle, bfile, &flist[1], &flist[2]);
+			break;
+		}
 		f = flist[1];
 		chunks2 = chunks3 = wiggle_split_patch(f, &flist[1], &flist[2]);
 		break;
@@ -483,11 +661,35 @@ static int do_merge(int argc, char *argv[], int obj, int blanks,
 	}
 
 	for (i = 0; i < 3; i++) {
-		if (flist[i].body == NULL) {
+		if (flist[i].body == NULL && !(i == 0 && origfile)) {
 			fprintf(stderr, "%s: file %d missing\n", wiggle_Cmd, i);
 			return 2;
 		}
 	}
+	if (obj == 'l')
+		blanks |= ByLine;
+	else
+		blanks |= ByWord;
+	if (wiggle_max_memory && !origfile) {
+		int fallback = budget_merge(flist, &blanks, &obj,
+					    argc == 2 && !check);
+
+		if (fallback == BudgetWindow) {
+			origfile = fmemopen(flist[0].body, flist[0].len, "r");
+			if (!origfile)
+				fallback = BudgetFail;
+			window = BUDGET_WINDOW;
+		}
+		if (fallback == BudgetFail) {
+			fprintf(stderr, "%s: %s: cannot merge within --max-memory\n",
+				wiggle_Cmd, argv[0]);
+			return 2;
+		}
+		if (fallback && !quiet)
+			fprintf(stderr, "%s: %s: over --max-memory, merging %s\n",
+				wiggle_Cmd, argv[0], budget_names[fallback]);
+	}
+	/* Only create the output once the merge is known to go ahead */
 	if (outfilename) {
 		outfile = fopen(outfilename, "w");
 		if (!outfile) {
@@ -496,65 +698,82 @@ static int do_merge(int argc, char *argv[], int obj, int blanks,
 			return 2;
 		}
 	} else if (replace) {
-		int fd;
-		replacename = wiggle_xmalloc(strlen(argv[0]) + 20);
-		orignew = wiggle_xmalloc(strlen(argv[0]) + 20);
-		strcpy(replacename, argv[0]);
-		strcpy(orignew, argv[0]);
-		strcat(orignew, ".porig");
-		if (backup && (open(orignew, O_RDONLY) >= 0 ||
-			       errno != ENOENT)) {
-			fprintf(stderr, "%s: %s already exists\n",
-				wiggle_Cmd,
-				orignew);
-			free(replacename);
-			free(orignew);
+		if (wiggle_file_compressed(argv[0])) {
+			fprintf(stderr, "%s: %s is compressed, cannot replace it\n",
+				wiggle_Cmd, argv[0]);
+			return 2;
+		}
+		outfile = wiggle_replace_open(&rp, argv[0], backup, 1);
+		if (!outfile && errno == EEXIST) {
+			fprintf(stderr, "%s: %s.porig already exists\n",
+				wiggle_Cmd, argv[0]);
 			return 2;
 		}
-		strcat(replacename, "XXXXXX");
-		fd = mkstemp(replacename);
-		if (fd == -1) {
+		if (!outfile) {
 			fprintf(stderr,
-				"%s: could not create temporary file for %s\n",
-				wiggle_Cmd,
-				replacename);
-			free(replacename);
-			free(orignew);
+				"%s: could not create temporary file for %s - %s\n",
+				wiggle_Cmd, argv[0], strerror(errno));
 			return 2;
 		}
-		outfile = fdopen(fd, "w");
 	}
 
-	if (obj == 'l')
-		blanks |= ByLine;
-	else
-		blanks |= ByWord;
+	if (origfile) {
+		ci = wiggle_window_merge(outfile, origfile, flist[1], flist[2],
+					 blanks, obj == 'w', window, ignore,
+					 show_wiggles > 1, diff_flags);
+		if (origfile != stdin)
+			fclose(origfile);
+		if (ci.conflicts < 0) {
+			if (outfilename)
+				fclose(outfile);
+			else if (replace)
+				wiggle_replace_abort(&rp);
+			return 2;
+		}
+		goto report;
+	}
+	wiggle_plan(flist, &blanks, &diff_flags,
+		    chunks2 && !chunks1 ? chunks2 : 0);
+	if (wiggle_do_trace)
+		gettimeofday(&start, NULL);
 	fl[0] = wiggle_split_stream(flist[0], blanks);
-	fl[1] = wiggle_split_stream(flist[1], blanks);
-	fl[2] = wiggle_split_stream(flist[2], blanks);
-	if (!(blanks & WholeWord) &&
-	    fl[1].elcnt > 50000 &&
-	    (fl[0].elcnt > 50000 || fl[2].elcnt > 50000)) {
-		/* Too many words */
-		free(fl[0].list);
-		free(fl[1].list);
-		free(fl[2].list);
-		blanks |= WholeWord;
-		fl[0] = wiggle_split_stream(flist[0], blanks);
+	/* The bundle has the patch split and diffed, but not reversed */
+	if (!bundle || reverse ||
+	    !wiggle_bundle_words(bundle, bfile, blanks, diff_flags,
+				 &fl[1], &fl[2], &csl2)) {
 		fl[1] = wiggle_split_stream(flist[1], blanks);
 		fl[2] = wiggle_split_stream(flist[2], blanks);
 	}
 
-	if (chunks2 && !chunks1)
+	if (chunks2 && !chunks1) {
 		csl1 = wiggle_pdiff(fl[0], fl[1], chunks2);
-	else
-		csl1 = wiggle_diff(fl[0], fl[1], shortest);
-	csl2 = wiggle_diff_patch(fl[1], fl[2], shortest);
+		if (wiggle_search_dir)
+			wiggle_relocate(argv[0], fl[1], csl1, blanks);
+	} else
+		csl1 = wiggle_diff(fl[0], fl[1], diff_flags);
+	if (!csl2)
+		csl2 = wiggle_diff_patch(fl[1], fl[2], diff_flags);
+	if (wiggle_do_trace) {
+		gettimeofday(&stop, NULL);
+		fprintf(stderr, "%s: %s: diffs took %ldms\n", wiggle_Cmd,
+			argv[0], (stop.tv_sec - start.tv_sec) * 1000 +
+			(stop.tv_usec - start.tv_usec) / 1000);
+	}
 
-	ci = wiggle_make_merger(fl[0], fl[1], fl[2], csl1, csl2,
-			 obj == 'w', ignore, show_wiggles > 1);
-	wiggle_print_merge(outfile, &fl[0], &fl[1], &fl[2],
-		    obj == 'w', ci.merger, NULL, 0, 0);
+	if (check)
+		/* Only the counts are wanted.  If they won't be reported
+		 * and wiggles don't matter, the first conflict is enough.
+		 */
+		ci = wiggle_check_merger(fl[0], fl[1], fl[2], csl1, csl2,
+					 obj == 'w', ignore, show_wiggles > 1,
+					 quiet && !show_wiggles);
+	else {
+		ci = wiggle_make_merger(fl[0], fl[1], fl[2], csl1, csl2,
+					obj == 'w', ignore, show_wiggles > 1);
+		wiggle_print_merge(outfile, &fl[0], &fl[1], &fl[2],
+				   obj == 'w', ci.merger, NULL, 0, 0);
+	}
+report:
 	if (!quiet && ci.conflicts)
 		fprintf(stderr,
 			"%d unresolved conflict%s found\n",
@@ -568,61 +787,186 @@ static int do_merge(int argc, char *argv[], int obj, int blanks,
 
 	if (outfilename)
 		fclose(outfile);
-	else if (replace) {
-		struct stat statbuf;
-
-		if (stat(argv[0], &statbuf) != 0) {
-			fprintf(stderr,
-				"%s: failed to stat original file. - %s\n",
-				wiggle_Cmd, strerror(errno));
-			free(replacename);
-			free(orignew);
-			return 2;
-		}
-		if (fchmod(fileno(outfile), statbuf.st_mode) != 0) {
-			fprintf(stderr,
-				"%s: failed to change permission of new file. - %s\n",
-				wiggle_Cmd, strerror(errno));
-			free(replacename);
-			free(orignew);
-			return 2;
-		}
-		fclose(outfile);
-		if ((!backup || rename(argv[0], orignew) == 0) &&
-		    rename(replacename, argv[0]) == 0)
-			/* all ok */;
-		else {
-			fprintf(stderr,
-				"%s: failed to move new file into place.\n",
-				wiggle_Cmd);
-			free(replacename);
-			free(orignew);
-			return 2;
-		}
+	else if (replace && wiggle_replace_commit(&rp) != 0) {
+		fprintf(stderr, "%s: failed to %s. - %s\n",
+			wiggle_Cmd, rp.failed, strerror(errno));
+		return 2;
 	}
-	free(replacename);
-	free(orignew);
+	if (conflictsp)
+		*conflictsp = ci.conflicts;
 	if (show_wiggles)
 		return ci.conflicts + ci.wiggles > 0;
 	else
 		return ci.conflicts > 0;
 }
 
+/* A journal records each file of a multi-file merge as a "started"
+ * line before it is replaced, and a "done" (or "failed") line after.
+ * Each line gives the byte range of its patch, the number of conflicts
+ * and the file name.  If the merge is interrupted and run again with
+ * the same journal, files recorded as done are skipped, and those only
+ * started are marked with calced == 2 for journal_check().
+ * Returns the journal opened for appending further entries.
+ */
+static FILE *journal_open(char *name, struct plist *pl, int num_patches)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int i = 0;
+
+	f = fopen(name, "a+");
+	if (!f)
+		return NULL;
+	rewind(f);
+	while ((len = getline(&line, &size, f)) > 0) {
+		int start, end, conflicts, n = 0;
+		char state[10];
+		int calced;
+		int j;
+
+		if (line[len-1] != '\n')
+			/* incomplete final entry */
+			break;
+		line[len-1] = 0;
+		if (sscanf(line, "%9s %d %d %d %n", state, &start, &end,
+			   &conflicts, &n) < 4 || n == 0)
+			continue;
+		if (strcmp(state, "done") == 0)
+			calced = 1;
+		else if (strcmp(state, "started") == 0)
+			calced = 2;
+		else
+			calced = 0;
+		/* Entries are normally in patch order, so look from
+		 * just after the last one found.
+		 */
+		for (j = 0; j < num_patches; j++, i++) {
+			if (i >= num_patches)
+				i = 0;
+			if (pl[i].start == (unsigned int)start &&
+			    pl[i].end == (unsigned int)end &&
+			    strcmp(pl[i].file, line + n) == 0) {
+				pl[i].calced = calced;
+				pl[i].conflicts = conflicts;
+				break;
+			}
+		}
+	}
+	free(line);
+	return f;
+}
+
+static int journal_entry(FILE *jf, char *state, struct plist *p,
+			 int conflicts)
+{
+	fprintf(jf, "%s %u %u %d %s\n", state, p->start, p->end,
+		conflicts, p->file);
+	if (fflush(jf) != 0)
+		return -1;
+	if (wiggle_sync_mode == SyncFile && fsync(fileno(jf)) != 0)
+		return -1;
+	return 0;
+}
+
+/* 'file' was started but not finished before an interruption.
+ * wiggle_replace_commit() links the original to .porig before renaming
+ * the new file over it, so .porig shows how far it got.  If the new
+ * file was not yet in place, the backup is undone.
+ * Returns 1 if 'file' was replaced, 0 if it is to be merged again, or
+ * -1 if that cannot be told.
+ */
+static int journal_check(char *file, int backup)
+{
+	struct stat stb, pstb;
+	char *porig;
+	int ret = -1;
+
+	if (!backup)
+		return -1;
+	asprintf(&porig, "%s.porig", file);
+	if (lstat(porig, &pstb) != 0) {
+		if (errno == ENOENT)
+			ret = 0;
+	} else if (lstat(file, &stb) != 0) {
+		/* moved aside where hard links weren't possible */
+		if (errno == ENOENT && rename(porig, file) == 0)
+			ret = 0;
+	} else if (stb.st_dev == pstb.st_dev && stb.st_ino == pstb.st_ino) {
+		if (unlink(porig) == 0)
+			ret = 0;
+	} else
+		ret = 1;
+	free(porig);
+	return ret;
+}
+
+/* Like wiggle_set_prefix() finding how much to strip from the names
+ * in the patch, but looking for the files in git revision 'rev'.
+ */
+static int git_strip(char *rev, struct plist *pl, int num_patches)
+{
+	int i, strip;
+
+	for (i = 0; i < 4 && i < num_patches; i++) {
+		char *p = pl[i].file;
+
+		for (strip = 0; p && *p; strip++) {
+			char *object;
+			struct stream s;
+
+			asprintf(&object, "%s:%s", rev, p);
+			s = wiggle_git_load(object);
+			free(object);
+			if (s.body) {
+				free(s.body);
+				return strip;
+			}
+			p = strchr(p, '/');
+			if (p)
+				while (*p == '/')
+					p++;
+		}
+	}
+	return -1;
+}
+
+/* Create the directories leading to 'path' */
+static void make_parents(char *path)
+{
+	char *slash;
+
+	for (slash = strchr(path + 1, '/'); slash;
+	     slash = strchr(slash + 1, '/')) {
+		*slash = 0;
+		mkdir(path, 0777);
+		*slash = '/';
+	}
+}
+
 static int multi_merge(int argc, char *argv[], int obj, int blanks,
 		       int reverse, int ignore, int show_wiggles,
 		       int replace, int strip,
-		       int quiet, int shortest, int backup)
+		       int quiet, int diff_flags, int backup, int check,
+		       int window, char *journal,
+		       char *revision, char *outdir)
 {
+	/* With 'revision', the files to patch are read from git, and
+	 * the results written under 'outdir' if it is given.
+	 */
 	FILE *f;
+	FILE *jf = NULL;
 	char *filename;
 	struct plist *pl;
+	struct bundle *bundle;
 	int num_patches;
 	int rv = 0;
 	int i;
 
-	if (!replace) {
+	if (!replace && !check) {
 		fprintf(stderr,
-			"%s: -p in merge mode requires -r\n",
+			"%s: -p in merge mode requires -r or --check\n",
 			wiggle_Cmd);
 		return 2;
 	}
@@ -633,32 +977,149 @@ static int multi_merge(int argc, char *argv[], int obj, int blanks,
 		return 2;
 	}
 	filename = argv[0];
-	f = fopen(filename, "r");
-	if (!f) {
-		fprintf(stderr, "%s: cannot open %s\n",
-			wiggle_Cmd, filename);
+	bundle = wiggle_bundle_open(filename);
+	if (bundle)
+		pl = wiggle_bundle_plist(bundle, &num_patches);
+	else if (errno)
+		return 2;
+	else {
+		f = wiggle_fopen(filename);
+		if (!f) {
+			fprintf(stderr, "%s: cannot open %s\n",
+				wiggle_Cmd, filename);
+			return 2;
+		}
+		pl = wiggle_parse_patch(f, NULL, &num_patches);
+		fclose(f);
+	}
+	if (revision && !wiggle_git_valid(revision)) {
+		fprintf(stderr, "%s: %s is not a revision in this git repository\n",
+			wiggle_Cmd, revision);
 		return 2;
 	}
-	wiggle_check_dir(filename, fileno(f));
-	pl = wiggle_parse_patch(f, NULL, &num_patches);
-	fclose(f);
+	if (revision && strip < 0)
+		strip = git_strip(revision, pl, num_patches);
 	if (wiggle_set_prefix(pl, num_patches, strip) == 0) {
 		fprintf(stderr, "%s: aborting\n", wiggle_Cmd);
 		return 2;
 	}
+	if (journal) {
+		jf = journal_open(journal, pl, num_patches);
+		if (!jf) {
+			fprintf(stderr, "%s: cannot open journal %s - %s\n",
+				wiggle_Cmd, journal, strerror(errno));
+			return 2;
+		}
+	}
 	for (i = 0; i < num_patches; i++) {
-		char *name;
+		char *name, *orig = NULL, *target = NULL;
 		char *av[2];
+		int conflicts = 0;
+		int replaced = 0;
+		int r;
+
+		if (pl[i].calced == 1) {
+			/* Done by an earlier run */
+			if (pl[i].conflicts)
+				rv |= 1;
+			continue;
+		}
+		if (pl[i].calced == 2) {
+			replaced = journal_check(pl[i].file, backup);
+			if (replaced < 0) {
+				fprintf(stderr, "%s: cannot tell whether %s was replaced before the interruption\n",
+					wiggle_Cmd, pl[i].file);
+				rv |= 2;
+				continue;
+			}
+		}
 		asprintf(&name, "_wiggle_:%d:%d:%s",
 			 pl[i].start, pl[i].end, filename);
 		av[0] = pl[i].file;
 		av[1] = name;
-		rv |= do_merge(2, av, obj, blanks, reverse, 1, NULL, ignore,
-			       show_wiggles, quiet, shortest, backup);
+		if (replaced) {
+			/* Only the conflicts need counting again */
+			asprintf(&orig, "%s.porig", pl[i].file);
+			av[0] = orig;
+			target = strdup("/dev/null");
+		}
+		if (revision) {
+			asprintf(&orig, "_wiggle_git_:%s:%s",
+				 revision, pl[i].file);
+			av[0] = orig;
+		}
+		if (revision && outdir) {
+			asprintf(&target, "%s/%s", outdir, pl[i].file);
+			make_parents(target);
+		}
+		if (check && !quiet)
+			fprintf(stderr, "%s:\n", pl[i].file);
+		if (jf && !replaced &&
+		    journal_entry(jf, "started", &pl[i], 0) != 0) {
+			fprintf(stderr, "%s: cannot write journal %s - %s\n",
+				wiggle_Cmd, journal, strerror(errno));
+			free(orig);
+			free(target);
+			rv |= 2;
+			break;
+		}
+		r = do_merge(2, av, obj, blanks, reverse,
+			     !check && !revision && !target,
+			     target, ignore, show_wiggles, quiet, diff_flags,
+			     backup, check, window, &conflicts, bundle, i);
+		free(orig);
+		free(target);
+		rv |= r;
+		if (jf && journal_entry(jf, r < 2 ? "done" : "failed",
+					&pl[i], conflicts) != 0) {
+			fprintf(stderr, "%s: cannot write journal %s - %s\n",
+				wiggle_Cmd, journal, strerror(errno));
+			rv |= 2;
+			break;
+		}
+		if (check && quiet && !show_wiggles && rv)
+			/* We already know the answer */
+			break;
 	}
+	if (jf)
+		fclose(jf);
 	return rv;
 }
 
+#ifndef WIGGLE_BROWSE
+#define BROWSER "wiggle-browse"
+
+/* The browser is a separate program so that the batch functions
+ * don't need to load ncurses.  Look for it beside this program,
+ * then on $PATH, and give it the same arguments.
+ */
+static void run_browser(char *argv[])
+{
+	char path[PATH_MAX];
+	char *slash;
+	ssize_t n;
+
+	n = readlink("/proc/self/exe", path, sizeof(path) - sizeof(BROWSER));
+	if (n <= 0 && strchr(argv[0], '/') &&
+	    strlen(argv[0]) < sizeof(path) - sizeof(BROWSER)) {
+		strcpy(path, argv[0]);
+		n = strlen(path);
+	}
+	if (n > 0) {
+		path[n] = 0;
+		slash = strrchr(path, '/');
+		if (slash) {
+			strcpy(slash + 1, BROWSER);
+			execv(path, argv);
+		}
+	}
+	execvp(BROWSER, argv);
+	fprintf(stderr, "%s: cannot run %s for --browse - %s\n",
+		wiggle_Cmd, BROWSER, strerror(errno));
+	exit(2);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 	int opt;
@@ -674,17 +1135,40 @@ int main(int argc, char *argv[])
 	int strip = -1;
 	int exit_status = 0;
 	int ignore = 1;
-	int shortest = 0;
+	int diff_flags = 0;
 	int show_wiggles = 0;
 	char *helpmsg;
 	char *trace;
 	char *outfile = NULL;
 	int selftest = 0;
 	int ignore_blanks = 0;
+	int check = 0;
+	int window = 0;
+	char *journal = NULL;
+	char *bundle = NULL;
+	char *revision = NULL;
+	int watch = 0;
+	struct stat stb;
+	char *end;
+
+#ifndef WIGGLE_BROWSE
+	/* getopt reorders argv, but the browser needs it as given */
+	char **browse_argv = wiggle_xmalloc((argc + 1) * sizeof(char *));
 
+	memcpy(browse_argv, argv, (argc + 1) * sizeof(char *));
+#endif
 	trace = getenv("WIGGLE_TRACE");
 	if (trace && *trace)
 		wiggle_do_trace = 1;
+	trace = getenv("WIGGLE_TRACE_FD");
+	if (trace && *trace) {
+		wiggle_trace_file = fdopen(atoi(trace), "w");
+		if (!wiggle_trace_file)
+			fprintf(stderr, "%s: WIGGLE_TRACE_FD=%s: %s\n",
+				wiggle_Cmd, trace, strerror(errno));
+		else
+			setvbuf(wiggle_trace_file, NULL, _IOLBF, 0);
+	}
 
 	while ((opt = getopt_long(argc, argv,
 				  short_options, long_options,
@@ -741,7 +1225,81 @@ int main(int argc, char *argv[])
 			continue;
 
 		case SHORTEST:
-			shortest = 1;
+			diff_flags |= DiffShortest;
+			continue;
+
+		case PATIENCE:
+			diff_flags |= DiffPatience;
+			continue;
+
+		case CHECK:
+			check = 1;
+			continue;
+
+		case SYNC:
+			if (strcmp(optarg, "none") == 0)
+				wiggle_sync_mode = SyncNone;
+			else if (strcmp(optarg, "file") == 0)
+				wiggle_sync_mode = SyncFile;
+			else if (strcmp(optarg, "batch") == 0)
+				wiggle_sync_mode = SyncBatch;
+			else {
+				fprintf(stderr,
+					"%s: --sync must be none, file or batch\n",
+					wiggle_Cmd);
+				exit(2);
+			}
+			continue;
+
+		case MAX_MEMORY:
+			wiggle_max_memory = strtol(optarg, &end, 10);
+			switch (*end) {
+			case 'g': case 'G':
+				wiggle_max_memory *= 1024;
+				/* fall through */
+			case 'm': case 'M':
+				wiggle_max_memory *= 1024;
+				/* fall through */
+			case 'k': case 'K':
+				wiggle_max_memory *= 1024;
+				end++;
+			}
+			if (wiggle_max_memory <= 0 || *end) {
+				fprintf(stderr,
+					"%s: --max-memory needs a size such as 500M\n",
+					wiggle_Cmd);
+				exit(2);
+			}
+			continue;
+
+		case JOURNAL:
+			journal = optarg;
+			continue;
+
+		case COMPILE:
+			bundle = optarg;
+			continue;
+
+		case REVISION:
+			revision = optarg;
+			continue;
+
+		case WATCH:
+			watch = 1;
+			continue;
+
+		case SEARCH:
+			wiggle_search_dir = optarg;
+			continue;
+
+		case MERGE_WINDOW:
+			window = atoi(optarg);
+			if (window <= 0) {
+				fprintf(stderr,
+					"%s: --window needs a positive number of lines\n",
+					wiggle_Cmd);
+				exit(2);
+			}
 			continue;
 
 		case 'w':
@@ -815,11 +1373,17 @@ int main(int argc, char *argv[])
 		mode = 'm';
 
 	if (mode == 'B') {
+#ifdef WIGGLE_BROWSE
 		vpatch(argc-optind, argv+optind, ispatch,
 		       strip, reverse, replace, outfile, selftest,
 		       ignore_blanks, backup);
 		/* should not return */
 		exit(1);
+#else
+		/* selftest is only for the browser */
+		(void)selftest;
+		run_browser(browse_argv);
+#endif
 	}
 
 	if (obj && mode == 'x') {
@@ -830,11 +1394,68 @@ int main(int argc, char *argv[])
 	}
 	if (mode != 'm' && !obj)
 		obj = 'w';
-	if (ispatch && outfile) {
+	if (revision && (mode != 'm' || !ispatch || window || bundle ||
+			 journal || (!check && !outfile))) {
+		fprintf(stderr,
+			"%s: --revision only allowed with --merge --patch, and either --check or --output, not --window, --journal or --compile\n",
+			wiggle_Cmd);
+		exit(2);
+	}
+	if (ispatch && outfile && !revision) {
 		fprintf(stderr, "%s: --output incompatible with --patch\n",
 			wiggle_Cmd);
 		exit(2);
 	}
+	if (check && (mode != 'm' || replace)) {
+		fprintf(stderr,
+			"%s: --check only allowed with --merge, and not with --replace or --output\n",
+			wiggle_Cmd);
+		exit(2);
+	}
+	if (journal && (mode != 'm' || !ispatch || !replace)) {
+		fprintf(stderr,
+			"%s: --journal only allowed with --merge --patch --replace\n",
+			wiggle_Cmd);
+		exit(2);
+	}
+	if (bundle && (mode != 'm' || !ispatch || replace || check ||
+		       reverse || window || journal)) {
+		fprintf(stderr,
+			"%s: --compile only allowed with --merge --patch, and not with --replace, --check, --reverse, --window or --journal\n",
+			wiggle_Cmd);
+		exit(2);
+	}
+	if (window && mode != 'm') {
+		fprintf(stderr,
+			"%s: --window only allowed with --merge\n", wiggle_Cmd);
+		exit(2);
+	}
+	if (window && check) {
+		fprintf(stderr,
+			"%s: --window cannot be used with --check\n", wiggle_Cmd);
+		exit(2);
+	}
+	if (watch && (mode != 'm' || ispatch || window ||
+		      (!check && !outfile))) {
+		fprintf(stderr,
+			"%s: --watch only allowed with --merge, and either --check or --output, not --patch or --window\n",
+			wiggle_Cmd);
+		exit(2);
+	}
+	if (wiggle_search_dir &&
+	    (mode != 'm' || (!ispatch && argc - optind != 2) || window ||
+	     watch || revision || bundle)) {
+		fprintf(stderr,
+			"%s: --search only allowed with --merge and a patch, not --window, --watch, --revision or --compile\n",
+			wiggle_Cmd);
+		exit(2);
+	}
+	if (wiggle_search_dir && (stat(wiggle_search_dir, &stb) != 0 ||
+				  !S_ISDIR(stb.st_mode))) {
+		fprintf(stderr, "%s: --search: %s is not a directory\n",
+			wiggle_Cmd, wiggle_search_dir);
+		exit(2);
+	}
 	if (replace && mode != 'm') {
 		fprintf(stderr,
 			"%s: --replace or --output only allowed with --merge\n", wiggle_Cmd);
@@ -866,25 +1487,42 @@ int main(int argc, char *argv[])
 		exit_status = do_diff(argc-optind, argv+optind,
 				      (obj == 'l' ? ByLine : ByWord)
 				      | ignore_blanks,
-				      ispatch, which, reverse, shortest);
+				      ispatch, which, reverse, diff_flags);
 		break;
 	case 'm':
-		if (ispatch)
+		if (bundle && argc - optind != 1) {
+			fprintf(stderr,
+				"%s: --compile requires exactly one patch\n",
+				wiggle_Cmd);
+			exit_status = 2;
+		} else if (watch)
+			exit_status = wiggle_watch(argc-optind, argv+optind,
+						   obj, ignore_blanks, reverse,
+						   ignore, show_wiggles,
+						   outfile, quiet, diff_flags,
+						   check);
+		else if (bundle)
+			exit_status = wiggle_compile(argv[optind], bundle,
+						     (obj == 'l' ? ByLine : ByWord)
+						     | ignore_blanks,
+						     diff_flags);
+		else if (ispatch)
 			exit_status = multi_merge(argc-optind,
 						  argv+optind, obj,
 						  ignore_blanks,
 						  reverse, ignore,
 						  show_wiggles,
 						  replace, strip,
-						  quiet, shortest,
-						  backup);
+						  quiet, diff_flags,
+						  backup, check, window,
+						  journal, revision, outfile);
 		else
 			exit_status = do_merge(
 				argc-optind, argv+optind,
 				obj, ignore_blanks, reverse, replace,
 				outfile,
-				ignore, show_wiggles, quiet, shortest,
-				backup);
+				ignore, show_wiggles, quiet, diff_flags,
+				backup, check, window, NULL, NULL, 0);
 		break;
 	}
 	exit(exit_status);
@@ -27,6 +27,7 @@
 #include	<memory.h>
 #include	<getopt.h>
 #include	<stdlib.h>
+#include	<stdint.h>
 
 static inline void assert(int a)
 {
@@ -46,22 +47,57 @@ struct stream {
  * records the line offsets of the hunk.  These are 20+ bytes long.
  * "\0\d{5} \d{5} \d{5}{SP funcname}?\n\0"
  * The 3 numbers are: chunk number, starting line, number of lines.
+ * The 'hash' of such an element is the chunk number.
  * An element with len==0 marks EOF.
  */
 struct elmnt {
 	char *start;
-	int hash;
+	uint64_t hash;
 	short len, plen, prefix;
 };
 
+/* Hash a word or line 8 bytes at a time.
+ * With 64 bits, different tokens almost never share a hash, so match()
+ * rarely needs to compare the text, but it still must: tokens longer
+ * than 8 bytes can be made to collide.
+ * Hashes and words are saved in bundles and search indexes, so
+ * WIGGLE_HASH_VERSION must change whenever wiggle_hash() does, and
+ * WIGGLE_SPLIT_VERSION whenever wiggle_split_stream() divides text
+ * into words differently.
+ */
+#define WIGGLE_HASH_VERSION 1
+#define WIGGLE_SPLIT_VERSION 1
+
+static inline uint64_t wiggle_hash(const char *p, int len)
+{
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+	uint64_t w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 31;
+	}
+	if (len) {
+		for (w = 0; len; len--)
+			w = (w << 8) | (unsigned char)p[len-1];
+		h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 31;
+	}
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 29;
+	return h;
+}
+
 static inline int match(struct elmnt *a, struct elmnt *b)
 {
-	return
-		a->hash == b->hash &&
-		((a->start[0] == 0 && b->start[0] == 0)
-		 ||
-		 (a->len == b->len &&
-		  strncmp(a->start, b->start, a->len) == 0));
+	if (a->hash != b->hash)
+		return 0;
+	if (a->start[0] == 0 || b->start[0] == 0)
+		/* hunk headers only match each other */
+		return a->start[0] == b->start[0];
+	return a->len == b->len &&
+		strncmp(a->start, b->start, a->len) == 0;
 }
 
 /* end-of-line is important for narrowing conflicts.
@@ -104,20 +140,27 @@ struct file {
  * For word-wise merges, any Changed or Unchanged section that matches
  * a newline, or immediately follows a newline (in all files) can bound
  * a conflict.
+ *
+ * There can be a great many of these for a large word-wise merge, so
+ * the type and conflict fields are kept narrow and packed together.
  */
+enum mergetype {
+	End, Unmatched, Unchanged, Extraneous,
+	Changed, Conflict, AlreadyApplied,
+};
 struct merge {
-	enum mergetype {
-		End, Unmatched, Unchanged, Extraneous,
-		Changed, Conflict, AlreadyApplied,
-	} type, oldtype;
+	enum mergetype type:8, oldtype:8;
+	unsigned int in_conflict:8;
 	int a, b, c; /* start of ranges */
 	int al, bl, cl; /* length of ranges */
-	int c1, c2; /* this or next common-sequence */
-	int in_conflict;
 	int lo, hi; /* region of a Changed or Unchanged that is not involved
 		    * in a conflict.
 		    * These are distances from start of the "before" section,
 		    * not indexes into any file.
+		    * They are set for every Unchanged and Changed element,
+		    * not only those beside a conflict, and read for each
+		    * one by wiggle_print_merge(), so they are kept here
+		    * rather than in a side table.
 		    */
 
 };
@@ -148,13 +191,39 @@ extern struct stream wiggle_load_segment(FILE *f, unsigned int start,
 					 unsigned int end);
 extern int wiggle_set_prefix(struct plist *pl, int n, int strip);
 extern struct stream wiggle_load_file(char *name);
+extern FILE *wiggle_open_file(char *name, long *limitp);
+extern FILE *wiggle_fopen(char *name);
+
+/* Compressed formats that wiggle_decompress() recognises */
+enum {
+	COMPRESS_NONE = 0,
+	COMPRESS_GZIP,
+	COMPRESS_XZ,
+	COMPRESS_ZSTD,
+};
+extern int wiggle_compressed(char *buf, int len);
+extern int wiggle_maybe_compressed(int c);
+extern int wiggle_decompress(struct stream *s, char *name);
+extern int wiggle_file_compressed(char *name);
+
 extern int wiggle_split_patch(struct stream, struct stream*, struct stream*);
 extern int wiggle_split_merge(struct stream, struct stream*, struct stream*,
 			      struct stream*);
+extern int wiggle_extract(FILE *in, long limit, FILE *out,
+			  int ispatch, int which);
 extern struct file wiggle_split_stream(struct stream s, int type);
+extern int wiggle_count_stream(struct stream s, int type);
 extern struct csl *wiggle_pdiff(struct file a, struct file b, int chunks);
-extern struct csl *wiggle_diff(struct file a, struct file b, int shortest);
-extern struct csl *wiggle_diff_patch(struct file a, struct file b, int shortest);
+extern int wiggle_find_hunk(struct file a, struct file b, int blo, int bhi,
+			    int *xlop, int *xhip, int *sizep);
+extern struct csl *wiggle_diff(struct file a, struct file b, int flags);
+extern long wiggle_diff_cost(int a, int b);
+extern void wiggle_plan(struct stream s[3], int *type, int *flags,
+			int chunks);
+extern struct csl *wiggle_diff_patch(struct file a, struct file b, int flags);
+extern void wiggle_diff_stream(struct file a, struct file b, int flags,
+			       void (*emit)(void *data, struct csl *csl),
+			       void *data);
 extern struct csl *wiggle_diff_partial(struct file a, struct file b,
 				       int alo, int ahi, int blo, int bhi);
 extern struct csl *worddiff(struct stream f1, struct stream f2,
@@ -177,11 +246,81 @@ extern int wiggle_isolate_conflicts(struct file af, struct file bf, struct file
 extern struct ci wiggle_make_merger(struct file a, struct file b, struct file c,
 				    struct csl *c1, struct csl *c2, int words,
 				    int ignore_already, int show_wiggles);
+extern long wiggle_merge_cost(int a, int b, int c);
+extern struct ci wiggle_check_merger(struct file a, struct file b, struct file c,
+				     struct csl *c1, struct csl *c2, int words,
+				     int ignore_already, int show_wiggles,
+				     int first_only);
+extern struct ci wiggle_window_merge(FILE *out, FILE *orig,
+				     struct stream before, struct stream after,
+				     int type, int words, int window,
+				     int ignore_already, int show_wiggles,
+				     int diff_flags);
+
+/* Merging again as files change, see watch.c */
+extern int wiggle_watch(int argc, char *argv[], int obj, int blanks,
+			int reverse, int ignore, int show_wiggles,
+			char *outfilename, int quiet, int diff_flags,
+			int check);
+
+/* Looking for lost hunks in other files, see relocate.c */
+extern char *wiggle_search_dir;
+extern void wiggle_relocate(char *name, struct file b, struct csl *csl,
+			    int type);
+
+/* Files as they are in a git revision, see git.c */
+extern struct stream wiggle_git_load(char *object);
+extern int wiggle_git_valid(char *rev);
+
+/* Patches compiled for repeated use, see bundle.c */
+struct bundle;
+extern int wiggle_compile(char *patchname, char *name, int type, int flags);
+extern struct bundle *wiggle_bundle_open(char *name);
+extern struct plist *wiggle_bundle_plist(struct bundle *b, int *np);
+extern int wiggle_bundle_patch(struct bundle *b, int i,
+			       struct stream *before, struct stream *after);
+extern int wiggle_bundle_words(struct bundle *b, int i, int type, int flags,
+			       struct file *before, struct file *after,
+			       struct csl **csl);
+
+/* Replacing a file with a new version, see replace.c */
+struct replace {
+	FILE *out;
+	char *file;
+	char *base;	/* last component of 'file' */
+	int dirfd;	/* directory containing 'file' */
+	char *tmpname;	/* where the new file is, or will be, linked */
+	int tmpfile;	/* created with O_TMPFILE and not linked yet */
+	int moved;	/* original renamed to porig, not linked */
+	char *porig;
+	int backup;
+	char *failed;
+};
+enum { SyncNone, SyncFile, SyncBatch };
+extern int wiggle_sync_mode;
+extern FILE *wiggle_replace_open(struct replace *r, char *file, int backup,
+				 int check);
+extern int wiggle_replace_commit(struct replace *r);
+extern void wiggle_replace_abort(struct replace *r);
 
 extern void wiggle_die(char *reason);
 extern void wiggle_check_dir(char *name, int fd);
 extern void *wiggle_xmalloc(int len);
 extern int wiggle_do_trace;
+extern FILE *wiggle_trace_file;
+extern char *wiggle_trace_name;
+extern void wiggle_trace_event(char *event);
+extern long wiggle_trace_usec(void);
+extern long wiggle_max_memory;
+
+#define WIGGLE_PROGRESS_STEPS (1L << 20)
+enum { WIGGLE_CONTINUE, WIGGLE_HURRY, WIGGLE_CANCEL };
+extern int (*wiggle_progress_hook)(long steps);
+extern int wiggle_hurry;
+extern int wiggle_progress(long steps);
+/* Cheap enough to call from any inner loop that isn't per-symbol */
+#define wiggle_poll(steps) \
+	(wiggle_progress_hook ? wiggle_progress(steps) : wiggle_hurry)
 
 extern int vpatch(int argc, char *argv[], int patch, int strip,
 		  int reverse, int replace, char *outfile,
@@ -198,6 +337,16 @@ enum other_options {
 	NO_BACKUP,
 	NON_SPACE,
 	SHORTEST,
+	CHECK,
+	MERGE_WINDOW,
+	PATIENCE,
+	SYNC,
+	JOURNAL,
+	MAX_MEMORY,
+	COMPILE,
+	REVISION,
+	WATCH,
+	SEARCH,
 };
 extern char Usage[];
 extern char Help[];
@@ -215,3 +364,10 @@ enum {
 	IgnoreBlanks = 8, /* 'or'ed in */
 	WholeWord = 16,
 };
+
+/* flags for wiggle_diff() and wiggle_diff_patch() */
+enum {
+	DiffShortest = 1,	/* never give up on finding the shortest diff */
+	DiffPatience = 2,	/* anchor on tokens that are unique in both */
+	DiffLinesFirst = 4,	/* line up whole lines, then their words */
+};
@@ -43,6 +43,7 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %defattr(-,root,root,-)
 /usr/bin/wiggle
+/usr/bin/wiggle-browse
 %{_mandir}/man1/wiggle.1*
 %doc ANNOUNCE TODO notes
 %doc p p.help
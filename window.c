@@ -0,0 +1,220 @@
+/*
+ * wiggle - apply rejected patches
+ *
+ * Copyright (C) 2020 Neil Brown <neil@brown.name>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.
+ *
+ *    Author: Neil Brown
+ *    Email: <neil@brown.name>
+ */
+
+/*
+ * Merge a patch into a file that is too big to hold in memory.
+ *
+ * A normal merge loads the whole original, splits it into words,
+ * and aligns every hunk against all of it.  When the original is
+ * huge and the patch is small, nearly all of that work is wasted
+ * on text that the patch cannot possibly affect.
+ *
+ * Instead we read the original a line at a time.  Each hunk records
+ * the line in the original where it is expected to apply.  We collect
+ * 'window' lines either side of that, merging with any other hunks
+ * whose windows overlap, and merge just that region against just
+ * those hunks.  The lines between windows are far from any hunk so
+ * are copied straight through.
+ *
+ * Memory use is then bounded by the patch plus the largest group of
+ * windows.  The cost is that a hunk which has moved more than
+ * 'window' lines from where the patch says it belongs will not be
+ * found, and will be reported as a conflict.
+ */
+
+#define _GNU_SOURCE /* for getline */
+#include	"wiggle.h"
+#include	<stdlib.h>
+
+/* Append up to 'lines' lines from 'f' to 's', which has room
+ * for 'size' bytes.  Return the number of lines read.
+ * As with wiggle_load_file, a missing final newline is supplied.
+ */
+static int read_lines(FILE *f, struct stream *s, int *size, int lines)
+{
+	char *line = NULL;
+	size_t lsize = 0;
+	ssize_t len;
+	int cnt = 0;
+
+	while (cnt < lines && (len = getline(&line, &lsize, f)) > 0) {
+		if (s->len + len + 2 > *size) {
+			*size = (s->len + len + 2) * 2;
+			s->body = realloc(s->body, *size);
+			if (!s->body)
+				wiggle_die("memory allocation");
+		}
+		memcpy(s->body + s->len, line, len);
+		s->len += len;
+		if (line[len-1] != '\n')
+			s->body[s->len++] = '\n';
+		cnt++;
+	}
+	free(line);
+	if (s->body)
+		s->body[s->len] = 0;
+	return cnt;
+}
+
+/* Copy 'lines' lines (or all if < 0) from 'f' to 'out'. */
+static void copy_lines(FILE *f, FILE *out, int lines)
+{
+	char *line = NULL;
+	size_t lsize = 0;
+	ssize_t len;
+
+	while (lines && (len = getline(&line, &lsize, f)) > 0) {
+		fwrite(line, 1, len, out);
+		if (line[len-1] != '\n')
+			fputc('\n', out);
+		if (lines > 0)
+			lines--;
+	}
+	free(line);
+}
+
+/* Hunk headers carry the hunk number which both pdiff and the
+ * hash rely on.  When merging a subset of the hunks, they must be
+ * renumbered from 1.
+ */
+static void renumber(struct elmnt *e, int chunk)
+{
+	char buf[12];
+
+	snprintf(buf, sizeof(buf), "%5d", chunk);
+	memcpy(e->start+1, buf, 5);
+	e->hash = chunk;
+}
+
+struct ci wiggle_window_merge(FILE *out, FILE *orig,
+			      struct stream before, struct stream after,
+			      int type, int words, int window,
+			      int ignore_already, int show_wiggles,
+			      int diff_flags)
+{
+	struct file fb, fa;
+	int *hb, *ha, *start, *end;
+	int nb = 0, na = 0;
+	int i, h;
+	int lineno = 1; /* next line to be read from 'orig' */
+	struct stream ws = {NULL, 0};
+	int wsize = 0;
+	struct ci rv;
+
+	rv.conflicts = rv.wiggles = rv.ignored = 0;
+	rv.merger = NULL;
+
+	fb = wiggle_split_stream(before, type);
+	fa = wiggle_split_stream(after, type);
+	if (!(type & WholeWord) && fb.elcnt > 50000) {
+		/* Too many words */
+		free(fb.list);
+		free(fa.list);
+		type |= WholeWord;
+		fb = wiggle_split_stream(before, type);
+		fa = wiggle_split_stream(after, type);
+	}
+
+	/* Find the hunk headers in each half of the patch, and the
+	 * range of lines that each hunk is expected to cover.
+	 */
+	hb = wiggle_xmalloc(sizeof(int) * (fb.elcnt + 1));
+	ha = wiggle_xmalloc(sizeof(int) * (fa.elcnt + 1));
+	start = wiggle_xmalloc(sizeof(int) * (fb.elcnt + 1));
+	end = wiggle_xmalloc(sizeof(int) * (fb.elcnt + 1));
+	for (i = 0; i < fb.elcnt; i++)
+		if (fb.list[i].start[0] == '\0') {
+			int chunk, line, cnt;
+			sscanf(fb.list[i].start+1, "%d %d %d", &chunk, &line, &cnt);
+			start[nb] = line - window;
+			end[nb] = line + cnt + window;
+			hb[nb++] = i;
+		}
+	for (i = 0; i < fa.elcnt; i++)
+		if (fa.list[i].start[0] == '\0')
+			ha[na++] = i;
+	hb[nb] = fb.elcnt;
+	ha[na] = fa.elcnt;
+	if (nb != na || (fb.elcnt && hb[0] != 0) || (fa.elcnt && ha[0] != 0)) {
+		fprintf(stderr, "%s: patch hunks don't line up\n", wiggle_Cmd);
+		rv.conflicts = -1;
+		goto out;
+	}
+
+	for (h = 0; h < nb; ) {
+		struct file fo, sb, sa;
+		struct csl *csl1, *csl2;
+		struct ci ci;
+		int h2;
+		int hi = end[h];
+
+		/* Gather all hunks whose windows overlap this one */
+		for (h2 = h + 1; h2 < nb && start[h2] <= hi; h2++)
+			if (end[h2] > hi)
+				hi = end[h2];
+
+		if (start[h] > lineno) {
+			copy_lines(orig, out, start[h] - lineno);
+			lineno = start[h];
+		}
+		ws.len = 0;
+		lineno += read_lines(orig, &ws, &wsize, hi - lineno);
+
+		fo = wiggle_split_stream(ws, type);
+		sb.list = fb.list + hb[h];
+		sb.elcnt = hb[h2] - hb[h];
+		sa.list = fa.list + ha[h];
+		sa.elcnt = ha[h2] - ha[h];
+		for (i = h; i < h2; i++) {
+			renumber(&fb.list[hb[i]], i - h + 1);
+			renumber(&fa.list[ha[i]], i - h + 1);
+		}
+
+		csl1 = wiggle_pdiff(fo, sb, h2 - h);
+		csl2 = wiggle_diff_patch(sb, sa, diff_flags);
+		ci = wiggle_make_merger(fo, sb, sa, csl1, csl2, words,
+					ignore_already, show_wiggles);
+		wiggle_print_merge(out, &fo, &sb, &sa, words,
+				   ci.merger, NULL, 0, 0);
+		rv.conflicts += ci.conflicts;
+		rv.wiggles += ci.wiggles;
+		rv.ignored += ci.ignored;
+
+		/* This window is finished with */
+		free(ci.merger);
+		free(csl1);
+		free(csl2);
+		free(fo.list);
+		h = h2;
+	}
+	copy_lines(orig, out, -1);
+out:
+	free(ws.body);
+	free(hb);
+	free(ha);
+	free(start);
+	free(end);
+	free(fb.list);
+	free(fa.list);
+	return rv;
+}